@@ -3,6 +3,7 @@
 #include <iostream>
 #include <vector>
 #include <ctime>
+#include <chrono>
 
 #define STB_IMAGE_IMPLEMENTATION
 
@@ -16,9 +17,15 @@
 #include "hittable/bvh.h"
 #include "hittable/translate.h"
 #include "hittable/medium.h"
+#include "hittable/lightBvh.h"
+#include "hittable/instance.h"
+#include "hittable/motionBvh.h"
 #include "tool/objectReader.h"
+#include "tool/sparseVolume.h"
+#include "tool/bvhCache.h"
 
 #include "math/transform.h"
+#include "math/vec4.h"
 
 #include "texture.h"
 
@@ -48,6 +55,55 @@ void earth(std::ofstream& out ) {
 }
 
 
+void tiled_earth(std::ofstream& out) {
+    //  A small budget on purpose, so that tiles keep being evicted and reloaded
+    TextureCache::instance().set_budget(256 * 1024);
+
+    HittableList world;
+    auto earth_surface = make_shared<lambertian>(make_shared<tiled_image_texture>("textures/earthmap.jpg"));
+    for (int i = -2; i <= 2; ++i)
+        world.add(make_shared<Sphere>(point3(2.2 * i, 0, -abs(i) * 2.0), 1, earth_surface));
+
+    cam.max_depth = 10;
+    cam.vfov = 30;
+    cam.lookfrom = point3(0, 0, 12);
+    cam.lookat = point3(0, 0, 0);
+
+    cam.render(out, world);
+
+    TextureCache::instance().print_stats(std::clog);
+}
+
+
+//  The field of small random spheres of the book's cover scene, shared by the BVH benchmarks, on a
+//  grid of a in [-columns, columns) by b in [-rows, rows) : diffuse, metal or glass as on the
+//  cover, each rising by up to 0.5 during the shutter when `moving`. The same random numbers are
+//  drawn either way, so with the same seed a still and a moving field only differ by their motion.
+void add_sphere_field(HittableList& list, bool moving, int columns = 11, int rows = 11) {
+    for (int a = -columns; a < columns; a++) {
+        for (int b = -rows; b < rows; b++) {
+            auto choose_mat = Util::random_double();
+            point3 center(a + 0.9 * Util::random_double(), 0.2, b + 0.9 * Util::random_double());
+            auto center2 = center + vec3(0, Util::random_double(0, .5), 0);
+            if ((center - point3(4, 0.2, 0)).length() <= 0.9)
+                continue;
+
+            shared_ptr<material> sphere_material;
+            if (choose_mat < 0.8)
+                sphere_material = make_shared<lambertian>(color::random() * color::random());
+            else if (choose_mat < 0.95)
+                sphere_material = make_shared<metal>(color::random(0.5, 1), Util::random_double(0, 0.5));
+            else
+                sphere_material = make_shared<dielectric>(1.5);
+
+            if (moving)
+                list.add(make_shared<Sphere>(std::vector<point3>({ center, center2 }), 0.2, sphere_material));
+            else
+                list.add(make_shared<Sphere>(center, 0.2, sphere_material));
+        }
+    }
+}
+
 void randomSpheres( std::ofstream &out) {
 
     HittableList world;
@@ -121,7 +177,7 @@ void randomSpheres( std::ofstream &out) {
     cam.focus_dist = 3.4;
     cam.shutter_duration = 2;
 
-    cam.render(out, world);
+    cam.render(out, MotionBvh(world));
 }
 
 
@@ -223,9 +279,516 @@ void simple_light(std::ofstream& out) {
     cam.lookfrom = point3(26, 3, 6);
     cam.lookat = point3(0, 2, 0);
 
+    cam.render(out, world, LightBvh(world));
+}
+
+void many_lights(std::ofstream& out) {
+    HittableList world;
+
+    auto checker = make_shared<checker_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    world.add(make_shared<Sphere>(point3(0, 1, 0), 1, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(make_shared<Sphere>(point3(-3, 1, 0), 1, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    //  Thousands of small emitters, each too small to be found by diffuse bounces alone
+    for (int a = -40; a < 40; a++) {
+        for (int b = -15; b < 15; b++) {
+            point3 center(a * 0.5 + 0.3 * Util::random_double(), 0.05, b * 0.5 + 0.3 * Util::random_double());
+            if ((center - point3(0, 0.05, 0)).length() < 1.2 || (center - point3(-3, 0.05, 0)).length() < 1.2)
+                continue;
+
+            auto emit = 2 * color::random() + color(1, 1, 1);
+            world.add(make_shared<Sphere>(center, 0.05, make_shared<DiffuseLight>(emit)));
+        }
+    }
+
+    cam.background = color(0, 0, 0);
+    cam.max_depth = 10;
+
+    cam.vfov = 30;
+    cam.lookfrom = point3(8, 4, 10);
+    cam.lookat = point3(-1, 0.5, 0);
+
+    cam.render(out, bvhNode(world), LightBvh(world));
+}
+
+void environment_light(std::ofstream& out) {
+    HittableList world;
+
+    auto checker = make_shared<checker_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    world.add(make_shared<Sphere>(point3(0, 1, 0), 1, make_shared<lambertian>(color(0.7, 0.7, 0.7))));
+    world.add(make_shared<Sphere>(point3(-2.2, 1, 0), 1, make_shared<metal>(color(0.8, 0.8, 0.8), 0.0)));
+    world.add(make_shared<Sphere>(point3(2.2, 1, 0), 1, make_shared<dielectric>(1.5)));
+
+    //  Any lat-long image works, .hdr files keep their full dynamic range
+    cam.environment = make_shared<EnvironmentLight>("textures/earthmap.jpg");
+    cam.max_depth = 10;
+
+    cam.vfov = 30;
+    cam.lookfrom = point3(0, 3, 10);
+    cam.lookat = point3(0, 1, 0);
+
+    cam.render(out, world);
+}
+
+void perlin_smoke(std::ofstream& out) {
+    HittableList world;
+
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, white));
+
+    //  Cloud shaped by turbulence, bounded by a box
+    auto cloudBox = make_shared<Cube>(point3(0, 2, 0), vec3(6, 3, 4), white);
+    world.add(make_shared<HeterogeneousMedium>(cloudBox, make_shared<NoiseDensity>(0.8, 2.0), color(1, 1, 1)));
+
+    auto difflight = make_shared<DiffuseLight>(color(10, 10, 10));
+    world.add(make_shared<Sphere>(point3(4, 8, 3), 1.5, difflight));
+
+    cam.background = color(0.1, 0.1, 0.15);
+    cam.max_depth = 20;
+
+    cam.vfov = 30;
+    cam.lookfrom = point3(10, 4, 14);
+    cam.lookat = point3(0, 2, 0);
+
+    cam.render(out, world, LightBvh(world));
+}
+
+void cornell_fog(std::ofstream& out) {
+    HittableList world;
+
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<DiffuseLight>(color(15, 15, 15));
+
+    //  Room walls as thin boxes
+    world.add(make_shared<Cube>(point3(560, 277.5, 277.5), vec3(10, 555, 555), green));
+    world.add(make_shared<Cube>(point3(-5, 277.5, 277.5), vec3(10, 555, 555), red));
+    world.add(make_shared<Cube>(point3(277.5, -5, 277.5), vec3(555, 10, 555), white));
+    world.add(make_shared<Cube>(point3(277.5, 560, 277.5), vec3(555, 10, 555), white));
+    world.add(make_shared<Cube>(point3(277.5, 277.5, 560), vec3(555, 555, 10), white));
+    world.add(make_shared<Cube>(point3(278, 554, 279.5), vec3(130, 1, 105), light));
+
+    //  The two boxes turned about their vertical axis, as in the original Cornell box
+    double angle1 = -18 * Util::pi / 180, angle2 = 15 * Util::pi / 180;
+    world.add(make_shared<OrientedCube>(point3(347.5, 82.5, 377.5), vec3(165, 165, 165),
+        vec3(cos(angle1), 0, -sin(angle1)), vec3(0, 1, 0), white));
+    world.add(make_shared<OrientedCube>(point3(212.5, 165, 147.5), vec3(165, 330, 165),
+        vec3(cos(angle2), 0, -sin(angle2)), vec3(0, 1, 0), white));
+
+    //  Patchy fog filling the room : turbulence baked into a grid, mostly empty
+    perlin noise;
+    aabb roomBounds(point3(0, 0, 0), point3(555, 555, 555));
+    auto fog = make_shared<GridDensity>(roomBounds, 64, 64, 64, [&](const point3& p) {
+        return 0.3 * fmax(0.0, noise.turb(p / 60, 4) - 0.5);
+    });
+    auto room = make_shared<Cube>(point3(277.5, 277.5, 277.5), vec3(555, 555, 555), white);
+    world.add(make_shared<HeterogeneousMedium>(room, fog, color(1, 1, 1)));
+
+    cam.background = color(0, 0, 0);
+    cam.max_depth = 10;
+
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+
+    cam.render(out, world, LightBvh(world));
+}
+
+void sparse_cloud(std::ofstream& out) {
+    HittableList world;
+
+    world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(.5, .5, .5))));
+
+    //  Bake the cloud once, later runs only map the file
+    aabb cloudBounds(point3(-4, 0.5, -3), point3(4, 4.5, 3));
+    perlin noise;
+    auto cloud = SparseVolume::load_or_bake("./output/cloud.rtsv", cloudBounds, 128, [&](const point3& p) {
+        //  Turbulence faded toward the box edges so the cloud has a soft round shape
+        vec3 q = (p - point3(0, 2.5, 0)) * vec3(0.25, 0.5, 1.0 / 3);
+        double falloff = fmax(0.0, 1 - q.length());
+        return 20 * fmax(0.0, noise.turb(p, 4) * falloff - 0.1);
+    });
+    std::clog << "Cloud bricks in file : " << cloud->brick_count() << std::endl;
+    auto cloudBox = make_shared<Cube>(point3(0, 2.5, 0), vec3(8, 4, 6), make_shared<lambertian>(color(1, 1, 1)));
+    world.add(make_shared<HeterogeneousMedium>(cloudBox, cloud, color(0.9, 0.9, 0.9)));
+
+    cam.background = color(0.5, 0.65, 0.9);
+    cam.max_depth = 20;
+
+    cam.vfov = 35;
+    cam.lookfrom = point3(4, 3, 14);
+    cam.lookat = point3(0, 2.5, 0);
+
     cam.render(out, world);
 }
 
+void ray_sorting_benchmark(std::ofstream& out) {
+    //  randomSpheres at full size, in a BVH, rendered by the wavefront integrator without and
+    //  with ray reordering
+    HittableList spheres;
+
+    spheres.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+    add_sphere_field(spheres, false);
+    spheres.add(make_shared<Sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    spheres.add(make_shared<Sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    spheres.add(make_shared<Sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    HittableList world(make_shared<bvhNode>(spheres));
+
+    cam.renderMode = RenderMode::Wavefront;
+    cam.max_depth = 10;
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+
+    for (int sorted = 0; sorted < 2; ++sorted) {
+        cam.sort_rays = sorted == 1;
+
+        std::ostringstream discarded;
+        auto start = std::chrono::steady_clock::now();
+        cam.render(sorted == 1 ? static_cast<std::ostream&>(out) : discarded, world);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::clog << std::endl << (sorted == 1 ? "Sorted rays   : " : "Unsorted rays : ") << seconds << " s, "
+            << cam.rays_traced() / seconds / 1e6 << " Mrays/s" << std::endl;
+    }
+}
+
+void vector_math_benchmark() {
+    //  The vector kernels of intersection and scattering over the same random unit vectors, as
+    //  scalar vec3 and as SIMD vec4. Writes no image.
+    const int count = 1 << 12, passes = 2000;
+
+    std::vector<vec3> a3(count), b3(count);
+    std::vector<vec4> a4(count), b4(count);
+    for (int i = 0; i < count; ++i) {
+        a3[i] = random_unit_vector();
+        b3[i] = random_unit_vector();
+        a4[i] = vec4(a3[i]);
+        b4[i] = vec4(b3[i]);
+    }
+
+    //  Nanoseconds per call of op(i), results summed so the work can not be optimized out
+    auto run = [&](auto op, double& checksum) {
+        decltype(op(0)) sum{};
+        auto start = std::chrono::steady_clock::now();
+        for (int pass = 0; pass < passes; ++pass)
+            for (int i = 0; i < count; ++i)
+                sum += op(i);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        checksum += dot(sum, sum);
+        return seconds * 1e9 / (double(passes) * count);
+    };
+
+    auto report = [](const char* name, double scalar, double simd) {
+        std::cout << name << " : vec3 " << scalar << " ns, vec4 " << simd << " ns, x" << scalar / simd << std::endl;
+    };
+
+    double checksum = 0;
+    report("dot      ", run([&](int i) { return vec3(dot(a3[i], b3[i]), 0, 0); }, checksum),
+        run([&](int i) { return vec4(dot(a4[i], b4[i]), 0, 0); }, checksum));
+    report("cross    ", run([&](int i) { return cross(a3[i], b3[i]); }, checksum),
+        run([&](int i) { return cross(a4[i], b4[i]); }, checksum));
+    report("normalize", run([&](int i) { return unit_vector(a3[i] + b3[i]); }, checksum),
+        run([&](int i) { return unit_vector(a4[i] + b4[i]); }, checksum));
+    report("reflect  ", run([&](int i) { return reflect(a3[i], b3[i]); }, checksum),
+        run([&](int i) { return reflect(a4[i], b4[i]); }, checksum));
+    report("refract  ", run([&](int i) { return refract(a3[i], b3[i], 1 / 1.5); }, checksum),
+        run([&](int i) { return refract(a4[i], b4[i], Util::Real(1 / 1.5)); }, checksum));
+    std::cout << "(checksum " << checksum << ")" << std::endl;
+}
+
+void instanced_meshes(std::ofstream& out) {
+    //  10,000 copies of two OBJ meshes, each loaded once. The two level InstanceScene shares the
+    //  meshes between all their instances ; the same scene as one trs per copy, each over its own
+    //  Polygon, in a bvhNode is timed against it.
+    shared_ptr<Hittable> meshes[2];
+    try {
+        meshes[0] = make_shared<Polygon>(Reader::read_obj_file("./res/cube1.obj", make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+        meshes[1] = make_shared<Polygon>(Reader::read_obj_file("./res/diamond.obj", make_shared<metal>(color(0.8, 0.8, 0.9), 0.1)));
+    }
+    catch (const std::runtime_error& error) {
+        std::cout << error.what() << std::endl;
+        return;
+    }
+    //  Scale bringing each mesh to about 0.3 across, and the offset centering it over the ground
+    const double fit[2] = { 0.3, 0.3 / 90 };
+    const vec3 center[2] = { vec3(-0.5, 0, -0.5), vec3(0, 0, 0) };
+
+    InstanceScene instances;
+    int ids[2] = { instances.add_object(meshes[0]), instances.add_object(meshes[1]) };
+    HittableList copies;
+
+    const int side = 100;
+    for (int a = 0; a < side; ++a) {
+        for (int b = 0; b < side; ++b) {
+            int mesh = Util::random_int(0, 1);
+            double size = fit[mesh] * Util::random_double(0.7, 1.3);
+
+            //  Applied in call order : centered, sized, stood up (the diamond), turned, placed
+            TransformMatrix tMat;
+            tMat.translate(center[mesh]);
+            tMat.scale(vec3(size, size, size));
+            if (mesh == 1)
+                tMat.rotate_x(Util::pi / 2);
+            tMat.rotate_y(Util::random_double(0, 2 * Util::pi));
+            tMat.translate(vec3(0.5 * (a - side / 2) + 0.2 * Util::random_double(), mesh == 1 ? 78 * size : 0,
+                0.5 * (b - side / 2) + 0.2 * Util::random_double()));
+
+            instances.add_instance(ids[mesh], tMat);
+            copies.add(make_shared<trs>(make_shared<Polygon>(*static_pointer_cast<Polygon>(meshes[mesh])), tMat));
+        }
+    }
+    instances.build();
+
+    HittableList world;
+    world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+    std::clog << instances.instance_count() << " instances of " << instances.object_count() << " meshes, "
+        << instances.top_level_bytes() / 1024 << " KiB of instances and top level nodes" << std::endl;
+
+    cam.max_depth = 10;
+    cam.vfov = 30;
+    cam.lookfrom = point3(0, 6, 12);
+    cam.lookat = point3(0, 0, 0);
+
+    for (int twoLevel = 0; twoLevel < 2; ++twoLevel) {
+        HittableList scene = world;
+        if (twoLevel == 1)
+            scene.add(make_shared<InstanceScene>(instances));
+        else
+            scene.add(make_shared<bvhNode>(copies));
+
+        std::ostringstream discarded;
+        auto start = std::chrono::steady_clock::now();
+        cam.render(twoLevel == 1 ? static_cast<std::ostream&>(out) : discarded, scene);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::clog << std::endl << (twoLevel == 1 ? "Instance BVH : " : "trs in bvhNode : ") << seconds << " s, "
+            << cam.rays_traced() / seconds / 1e6 << " Mrays/s" << std::endl;
+    }
+}
+
+void motion_blur_benchmark(std::ofstream& out) {
+    //  The ray_sorting_benchmark field of small spheres, each jumping up to 0.5 during the shutter,
+    //  traced through a bvhNode whose boxes cover the whole motion and through a MotionBvh
+    HittableList still, moving;
+
+    auto ground = make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    still.add(ground);
+    moving.add(ground);
+    std::srand(1);
+    add_sphere_field(still, false);
+    std::srand(1);
+    add_sphere_field(moving, true);
+    for (HittableList* list : { &still, &moving }) {
+        list->add(make_shared<Sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+        list->add(make_shared<Sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+        list->add(make_shared<Sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+    }
+
+    cam.max_depth = 10;
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.shutter_duration = 1;
+
+    auto run = [&](const char* name, const Hittable& world, bool keep) {
+        std::ostringstream discarded;
+        auto start = std::chrono::steady_clock::now();
+        cam.render(keep ? static_cast<std::ostream&>(out) : discarded, world);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::clog << std::endl << name << seconds << " s, " << cam.rays_traced() / seconds / 1e6 << " Mrays/s" << std::endl;
+    };
+
+    run("Static, bvhNode    : ", bvhNode(still), false);
+    run("Static, MotionBvh  : ", MotionBvh(still), false);
+    run("Moving, bvhNode    : ", bvhNode(moving), false);
+    run("Moving, MotionBvh  : ", MotionBvh(moving), true);
+}
+
+void animated_refit(std::ofstream& out) {
+    //  Spheres swirling around the y axis, inner ones faster, over a few frames at a low sample
+    //  count : each frame the AnimatedBvh is refit, and rebuilt when the swirl has degraded it
+    //  enough. A full bvhNode build is timed on each frame for comparison.
+    const int count = 2000, frames = 12;
+
+    shared_ptr<material> materials[3] = { make_shared<lambertian>(color(0.7, 0.3, 0.2)),
+        make_shared<lambertian>(color(0.2, 0.4, 0.7)), make_shared<metal>(color(0.8, 0.8, 0.8), 0.2) };
+
+    HittableList spheres;
+    std::vector<shared_ptr<trs>> movers;
+    std::vector<double> radius(count), angle(count), height(count);
+    for (int i = 0; i < count; ++i) {
+        radius[i] = Util::random_double(1, 8);
+        angle[i] = Util::random_double(0, 2 * Util::pi);
+        height[i] = Util::random_double(0.15, 3);
+        auto ball = make_shared<Sphere>(point3(0, 0, 0), 0.15, materials[Util::random_int(0, 2)]);
+        movers.push_back(make_shared<trs>(ball));
+        spheres.add(movers.back());
+    }
+
+    auto place = [&](int frame) {
+        for (int i = 0; i < count; ++i) {
+            TransformMatrix tMat;
+            double a = angle[i] + 0.4 * frame / radius[i];
+            tMat.translate(vec3(radius[i] * cos(a), height[i], radius[i] * sin(a)));
+            movers[i]->set_transform(tMat);
+        }
+    };
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    place(0);
+    auto start = std::chrono::steady_clock::now();
+    auto tree = make_shared<AnimatedBvh>(spheres);
+    double updateTime = milliseconds(start);
+
+    HittableList world;
+    world.add(make_shared<Sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+    world.add(tree);
+
+    cam.samples_per_pixel = 2;
+    cam.max_depth = 5;
+    cam.vfov = 40;
+    cam.lookfrom = point3(0, 9, 14);
+    cam.lookat = point3(0, 0, 0);
+
+    for (int frame = 0; frame < frames; ++frame) {
+        bool rebuilt = frame == 0;
+        if (frame > 0) {
+            place(frame);
+            start = std::chrono::steady_clock::now();
+            rebuilt = tree->update();
+            updateTime = milliseconds(start);
+        }
+
+        start = std::chrono::steady_clock::now();
+        bvhNode full(spheres);
+        double buildTime = milliseconds(start);
+
+        std::ostringstream discarded;
+        start = std::chrono::steady_clock::now();
+        cam.render(frame == frames - 1 ? static_cast<std::ostream&>(out) : discarded, world);
+        double renderTime = milliseconds(start);
+
+        std::clog << std::endl << "Frame " << frame << " : " << (rebuilt ? "build " : "refit ") << updateTime
+            << " ms (full build " << buildTime << " ms), SAH cost " << tree->sah_cost() / tree->built_sah_cost()
+            << "x the last build's (full build " << full.sah_cost() / tree->built_sah_cost() << "x), render "
+            << renderTime << " ms" << std::endl;
+    }
+    std::clog << tree->rebuild_count() << " rebuilds over " << frames - 1 << " frames" << std::endl;
+}
+
+void bvh_build_benchmark(std::ofstream& out) {
+    //  A million small spheres : the recursive bvhNode build against the parallel linear BVH,
+    //  and the latter again through the BVH cache, from which it is read back on later runs.
+    //  Rendered at preview quality.
+    HittableList spheres;
+    shared_ptr<material> materials[3] = { make_shared<lambertian>(color(0.7, 0.3, 0.2)),
+        make_shared<lambertian>(color(0.2, 0.4, 0.7)), make_shared<lambertian>(color(0.8, 0.8, 0.8)) };
+    for (int i = 0; i < 1000000; ++i) {
+        point3 center(Util::random_double(-50, 50), Util::random_double(-50, 50), Util::random_double(-50, 50));
+        spheres.add(make_shared<Sphere>(center, 0.1, materials[i % 3]));
+    }
+
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    bvhNode recursive(spheres);
+    std::clog << "bvhNode        : " << milliseconds(start) << " ms, SAH cost " << recursive.sah_cost() << std::endl;
+
+    ThreadPool pool;
+    start = std::chrono::steady_clock::now();
+    bvhNode linear(spheres, pool);
+    std::clog << "Linear BVH, " << pool.size() << " threads : " << milliseconds(start) << " ms, SAH cost "
+        << linear.sah_cost() << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    auto cached = BvhCache::load_or_build(spheres, "./output", [&] { return make_shared<bvhNode>(spheres, pool); });
+    std::clog << "Cached BVH     : " << milliseconds(start) << " ms" << std::endl;
+
+    cam.samples_per_pixel = 1;
+    cam.max_depth = 3;
+    cam.vfov = 60;
+    cam.lookfrom = point3(0, 0, 90);
+    cam.lookat = point3(0, 0, 0);
+
+    cam.render(out, *cached);
+}
+
+void noise_benchmark() {
+    //  Turbulence at random points around the spheres of two_perlin_spheres : the scalar and
+    //  batched Perlin kernels, then NoiseTexture lookups before and after baking the turbulence
+    //  over the points' region. Writes no image.
+    const int count = 1 << 16, passes = 20;
+    const double freq = 4;
+    const aabb region(point3(-4, -4, -4), point3(4, 4, 4));
+
+    std::vector<point3> points(count);
+    std::vector<double> x(count), y(count), z(count), turb(count);
+    for (int i = 0; i < count; ++i) {
+        points[i] = point3(Util::random_double(-4, 4), Util::random_double(-4, 4), Util::random_double(-4, 4));
+        x[i] = freq * points[i].x();
+        y[i] = freq * points[i].y();
+        z[i] = freq * points[i].z();
+    }
+
+    //  Nanoseconds per point of pass()
+    auto run = [&](auto pass) {
+        auto start = std::chrono::steady_clock::now();
+        for (int p = 0; p < passes; ++p)
+            pass();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return seconds * 1e9 / (double(passes) * count);
+    };
+
+    perlin noise;
+    double scalarTime = run([&] {
+        for (int i = 0; i < count; ++i)
+            turb[i] = noise.turb(freq * points[i]);
+    });
+    double batchedTime = run([&] { noise.turb(x.data(), y.data(), z.data(), turb.data(), count); });
+    std::cout << "Scalar turb  : " << scalarTime << " ns" << std::endl;
+    std::cout << "Batched turb : " << batchedTime << " ns, x" << scalarTime / batchedTime << std::endl;
+
+    //  The texture amplifies the turbulence tenfold, so baking errors show in its values
+    NoiseTexture texture(freq, 0.5);
+    std::vector<color> exact(count), values(count);
+    auto lookups = [&] {
+        for (int i = 0; i < count; ++i)
+            values[i] = texture.value(0, 0, points[i]);
+    };
+
+    double unbakedTime = run(lookups);
+    exact = values;
+    std::cout << "NoiseTexture : " << unbakedTime << " ns" << std::endl;
+
+    for (double voxelsPerUnit : { 8.0, 32.0 }) {
+        auto start = std::chrono::steady_clock::now();
+        texture.bake(region, voxelsPerUnit);
+        double bakeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        double bakedTime = run(lookups);
+        double maxError = 0, sumError = 0;
+        for (int i = 0; i < count; ++i) {
+            double error = fabs(values[i].x() - exact[i].x());
+            maxError = fmax(maxError, error);
+            sumError += error;
+        }
+        std::cout << "Baked, " << voxelsPerUnit << " voxels per unit : " << bakedTime << " ns, x"
+            << unbakedTime / bakedTime << ", " << bakeTime << " ms to bake, error mean " << sumError / count
+            << " max " << maxError << std::endl;
+    }
+}
+
 int main() {
 
     string imageNameList[] = {
@@ -234,30 +797,52 @@ int main() {
         "earth",
         "two_perlin_spheres",
         "simple_light",
-        "cornell_smoke"
+        "cornell_smoke",
+        "many_lights",
+        "environment_light",
+        "perlin_smoke",
+        "cornell_fog",
+        "sparse_cloud",
+        "tiled_earth",
+        "ray_sorting_benchmark",
+        "vector_math_benchmark",
+        "instanced_meshes",
+        "motion_blur_benchmark",
+        "animated_refit",
+        "bvh_build_benchmark",
+        "noise_benchmark"
     };
-    unsigned int numImage = 6;
+    unsigned int numImage = 19;
 
     for (unsigned int i = 1; i <= numImage; i++) {
         std::cout << i << " : " << imageNameList[i-1] << std::endl;
     }
+    std::cout << "Image ID, optionally followed by w for the wavefront renderer" << std::endl;
 
     unsigned int id = 1;
-    string input;
-    std::cin >> input;
+    string line, input, mode;
+    std::getline(std::cin, line);
+    std::istringstream words(line);
+    words >> input >> mode;
 
     id = stoi(input);
+    bool wavefront = mode == "w";
 
     if ( id < 1 || id > numImage)
         throw std::runtime_error( "Image ID out of range" );
     
     string imagePath = "./output/" + imageNameList[id-1] + ".ppm";
 
-    std::ofstream out(imagePath);
+    //  Benchmarks that write no image do not create (or truncate) one
+    std::ofstream out;
+    if (id != 14 && id != 19)
+        out.open(imagePath);
 
     time_t start = time(NULL);
 
     setupCamera();
+    if (wavefront)
+        cam.renderMode = RenderMode::Wavefront;
 
     switch (id) {
         case 1: twoSpheres(out);            break;
@@ -266,6 +851,19 @@ int main() {
         case 4: two_perlin_spheres(out);    break;
         case 5: simple_light(out);          break;
         case 6: cornell_smoke(out);         break;
+        case 7: many_lights(out);           break;
+        case 8: environment_light(out);     break;
+        case 9: perlin_smoke(out);          break;
+        case 10: cornell_fog(out);          break;
+        case 11: sparse_cloud(out);         break;
+        case 12: tiled_earth(out);          break;
+        case 13: ray_sorting_benchmark(out); break;
+        case 14: vector_math_benchmark();   break;
+        case 15: instanced_meshes(out);     break;
+        case 16: motion_blur_benchmark(out); break;
+        case 17: animated_refit(out);       break;
+        case 18: bvh_build_benchmark(out);  break;
+        case 19: noise_benchmark();         break;
     }
     
     out.close();
@@ -1,10 +1,38 @@
 #include "camera.h"
 
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+#include "math/morton.h"
+
+static double powerHeuristic(double pdf, double otherPdf) {
+    // Multiple importance sampling weight of a sample drawn from `pdf`.
+    return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
+}
+
+void Camera::render(std::ostream& out, const Hittable& world, const LightBvh& lights) {
+    this->lights = lights.empty() ? nullptr : &lights;
+    render(out, world);
+    this->lights = nullptr;
+}
+
 void Camera::render(std::ostream& out, const Hittable& world) {
     initialize();
+    rayCount = 0;
+
+    //  Textures left undecoded by the scene setup load in the background from here on
+    TextureLoader::instance().prefetch();
 
     out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
+    //  Adaptive sampling decides on more samples from the colors already traced, it stays
+    //  depth first
+    if (renderMode == RenderMode::Wavefront && samplingMethod != SamplingMethod::AdaptiveSuperSampling) {
+        renderWavefront(out, world);
+        return;
+    }
+
     for (int j = 0; j < image_height; ++j) {
         std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
         for (int i = 0; i < image_width; ++i) {
@@ -57,22 +85,31 @@ void Camera::initialize() {
     defocus_disk_v = v * defocus_radius;
 }
 
-color Camera::rayColor(const ray& r, int depth, const Hittable& world) const {
+color Camera::rayColor(const RayDifferential& r, int depth, const Hittable& world, double scatterPdf) const {
     HitRecord rec;
 
     if (depth <= 0)
         return color(1.0, 1.0, 1.0);
 
-    if (world.hit(r, interval(0.001, Util::infinity), rec)) {
+    ++rayCount;
+    if (world.hit(r, interval(0, Util::infinity), rec)) {
         ScatteredRays scattered;
         color attenuation;
+        rec.compute_differentials(r);
         color colorFromEmission = rec.mat->emitted(rec.u, rec.v, rec.p);
 
+        //  The previous hit may also have reached this emitter through light sampling
+        if (scatterPdf > 0)
+            colorFromEmission = colorFromEmission * powerHeuristic(scatterPdf, lightPdf(r.origin(), r.direction()));
+
         if (rec.mat->scatter(r, rec, attenuation, scattered)) {
             color accuColor;
             for (unsigned int i = 0; i < scattered.size(); i++) {
                 ScatteredRay s = scattered[i];
-                color tmp = rayColor(s.r, depth - 1, world);
+                double pdf = hasLightSampling() ? rec.mat->scattering_pdf(r, rec, s.r) : 0;
+                color tmp = rayColor(s.r, depth - 1, world, pdf);
+                if (pdf > 0)
+                    tmp += sampleLights(r, rec, world);
                 accuColor += s.coeff * tmp;
             }
  
@@ -82,10 +119,76 @@ color Camera::rayColor(const ray& r, int depth, const Hittable& world) const {
         return colorFromEmission;
     }
     else {
-        return background;
+        color backgroundColor = environmentColor(r);
+        if (scatterPdf > 0)
+            backgroundColor = backgroundColor * powerHeuristic(scatterPdf, lightPdf(r.origin(), r.direction()));
+        return backgroundColor;
     }
 }
 
+color Camera::environmentColor(const ray& r) const {
+    return (environment != nullptr) ? environment->value(r.direction()) : background;
+}
+
+color Camera::incomingEmission(const ray& r, const Hittable& world) const {
+    // Emission from whatever is seen first along r, the same way a scattered ray would see it
+    // (so the MIS weights of light and BSDF sampling add up to one), attenuated by any medium
+    // crossed on the way.
+
+    HitRecord rec;
+    ++rayCount;
+    bool hitSurface = world.hit(r, interval(0, Util::infinity), rec);
+    while (hitSurface && rec.mat->is_volumetric())
+        hitSurface = world.hit(r, interval(rec.t, Util::infinity), rec);
+
+    color emission = hitSurface ? rec.mat->emitted(rec.u, rec.v, rec.p) : environmentColor(r);
+    if (emission.near_zero())
+        return emission;
+
+    return emission * world.transmittance(r, interval(0, hitSurface ? rec.t * (1 - Util::epsilon) : Util::infinity));
+}
+
+double Camera::lightPdf(const point3& origin, const vec3& direction) const {
+    // Density of sampleLights choosing `direction`, with the same strategy weights.
+    double pdf = 0;
+    double environmentWeight = (lights == nullptr) ? 1.0 : 0.5;
+    if (environment != nullptr)
+        pdf += environmentWeight * environment->pdf_value(direction);
+    if (lights != nullptr)
+        pdf += (1 - environmentWeight) * lights->pdf_value(origin, direction);
+    return pdf;
+}
+
+bool Camera::sampleLightRay(const ray& rIn, const HitRecord& rec, ray& shadowRay, double& weight) const {
+    vec3 direction;
+    bool useEnvironment = environment != nullptr && (lights == nullptr || Util::random_double() < 0.5);
+    if (useEnvironment)
+        direction = environment->random();
+    else if (lights->sample(rec.p, direction) == nullptr)
+        return false;
+
+    shadowRay = rec.spawn_ray(direction, rIn.time());
+    double pdf = lightPdf(shadowRay.origin(), direction);
+    double matPdf = rec.mat->scattering_pdf(rIn, rec, shadowRay);
+    if (pdf <= 0 || matPdf <= 0)
+        return false;
+
+    weight = matPdf * powerHeuristic(pdf, matPdf) / pdf;
+    return true;
+}
+
+color Camera::sampleLights(const ray& rIn, const HitRecord& rec, const Hittable& world) const {
+    // Direct lighting estimate along a direction chosen by the light BVH or the environment
+    // distribution, without the attenuation.
+
+    ray shadowRay;
+    double weight;
+    if (!sampleLightRay(rIn, rec, shadowRay, weight))
+        return color(0, 0, 0);
+
+    return incomingEmission(shadowRay, world) * weight;
+}
+
 point3 Camera::defocus_disk_sample() const {
     // Returns a random point in the camera defocus disk.
     auto p = random_in_unit_disk();
@@ -101,7 +204,7 @@ vec3 Camera::pixel_sample_square() const {
 
 void Camera::normalSampling(const Hittable& world, unsigned int i, unsigned int j, color& pixelColor) {
 
-    ray r = getRay(i, j);
+    RayDifferential r = getRay(i, j);
     pixelColor = rayColor(r, max_depth, world);
 
 }
@@ -109,7 +212,7 @@ void Camera::normalSampling(const Hittable& world, unsigned int i, unsigned int
 void Camera::superSampling(const Hittable& world, unsigned int i, unsigned int j, color& pixelColor) {
 
     for (int sample = 0; sample < samples_per_pixel; ++sample) {
-        ray r = getRay(i, j);
+        RayDifferential r = getRay(i, j);
         pixelColor += rayColor(r, max_depth, world);
     }
     pixelColor = pixelColor / samples_per_pixel;
@@ -200,4 +303,240 @@ void Camera::adaptiveSuperSampling(const Hittable& world, unsigned int i, unsign
 
     adaptiveSuperSamplingRecur(world, corners, depth, pixelColor, cornersColor);
 
-}
\ No newline at end of file
+}
+
+/*
+    Wavefront integrator : the same estimator as rayColor, but instead of following one path to
+    its end, every path of a batch of pixels goes through one stage before any path moves on to
+    the next one. Each stage is a tight loop over a queue, paths are shaded grouped by material
+    and their albedos looked up texture by texture through an AlbedoBatch.
+
+        generate  -> camera rays of the batch
+        intersect -> closest hit of every path
+        shade     -> emission and background, then scattering into the next queue and light
+                     samples into the shadow queue
+        shadow    -> visibility and emission of the light samples
+
+    Paths split by dielectric surfaces simply add lanes to the next queue.
+*/
+void Camera::renderWavefront(std::ostream& out, const Hittable& world) {
+    int numPixels = image_width * image_height;
+    int samples = samplingMethod == SamplingMethod::Normal ? 1 : samples_per_pixel;
+    int pixelsPerBatch = wavefront_size / samples > 0 ? wavefront_size / samples : 1;
+
+    //  Packets are square tiles of pixels, so batches hold whole rows of tiles
+    if (packet_size > 0) {
+        int tileRow = image_width * packet_size;
+        pixelsPerBatch = pixelsPerBatch > tileRow ? pixelsPerBatch / tileRow * tileRow : tileRow;
+    }
+
+    std::vector<pixel_sum> image(numPixels);
+    PathQueue paths, nextPaths, scratch;
+    ShadowQueue shadows;
+    std::vector<HitRecord> hits;
+    std::vector<char> isHit;
+
+    for (int first = 0; first < numPixels; first += pixelsPerBatch) {
+        std::clog << "\rScanlines remaining: " << (image_height - first / image_width) << ' ' << std::flush;
+
+        int count = numPixels - first < pixelsPerBatch ? numPixels - first : pixelsPerBatch;
+        generatePaths(first, count, samples, paths);
+
+        bool primary = true;
+        while (paths.size() > 0) {
+            //  Camera rays are already coherent, packed by generatePaths
+            if (sort_rays && !primary)
+                sortPaths(paths, scratch);
+            intersectPaths(paths, world, hits, isHit, primary);
+            primary = false;
+
+            nextPaths.clear();
+            shadows.clear();
+            shadePaths(paths, hits, isHit, image, nextPaths, shadows);
+            traceShadows(shadows, world, image);
+
+            std::swap(paths, nextPaths);
+        }
+    }
+
+    for (const pixel_sum& pixelColor : image)
+        write_color(out, pixelColor);
+}
+
+void Camera::generatePaths(int firstPixel, int numPixels, int samples, PathQueue& paths) const {
+    paths.clear();
+    color weight = color(1, 1, 1) / samples;
+
+    if (packet_size <= 0) {
+        for (int p = firstPixel; p < firstPixel + numPixels; ++p)
+            for (int sample = 0; sample < samples; ++sample)
+                paths.push(getRay(p % image_width, p / image_width), weight, p, max_depth, 0);
+        return;
+    }
+
+    //  One sample of every pixel of a tile after the other, so each run of packet_size^2 lanes
+    //  is a packet of neighbouring camera rays (firstPixel and numPixels are whole rows here)
+    int firstRow = firstPixel / image_width;
+    int lastRow = (firstPixel + numPixels) / image_width;
+    for (int tileY = firstRow; tileY < lastRow; tileY += packet_size)
+        for (int tileX = 0; tileX < image_width; tileX += packet_size)
+            for (int sample = 0; sample < samples; ++sample)
+                for (int y = tileY; y < tileY + packet_size && y < lastRow; ++y)
+                    for (int x = tileX; x < tileX + packet_size && x < image_width; ++x)
+                        paths.push(getRay(x, y), weight, y * image_width + x, max_depth, 0);
+}
+
+void Camera::sortPaths(PathQueue& paths, PathQueue& scratch) const {
+    // Orders the queue by direction octant, then by the Morton code of the origin inside the
+    // bounds of all origins : neighbouring rays then go through the same BVH nodes and
+    // primitives, which are still in cache from the previous ray.
+
+    int count = paths.size();
+    if (count < 2)
+        return;
+
+    point3 lo = paths.rays[0].origin(), hi = lo;
+    for (int i = 1; i < count; ++i)
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = fmin(lo[a], paths.rays[i].origin()[a]);
+            hi[a] = fmax(hi[a], paths.rays[i].origin()[a]);
+        }
+    vec3 extent = hi - lo;
+    for (int a = 0; a < 3; ++a)
+        extent[a] = extent[a] > 0 ? extent[a] : 1;
+
+    std::vector<std::pair<uint64_t, int>> keys(count);
+    for (int i = 0; i < count; ++i) {
+        const point3& o = paths.rays[i].origin();
+        const vec3& d = paths.rays[i].direction();
+        uint64_t octant = (d.x() < 0 ? 1 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 4 : 0);
+        uint32_t code = morton3((o.x() - lo.x()) / extent.x(), (o.y() - lo.y()) / extent.y(),
+            (o.z() - lo.z()) / extent.z());
+        keys[i] = std::make_pair((octant << 30) | code, i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    scratch.clear();
+    for (const auto& key : keys) {
+        int i = key.second;
+        scratch.push(paths.ray_differential(i), paths.throughput[i], paths.pixel[i], paths.depth[i],
+            paths.scatterPdf[i]);
+    }
+    std::swap(paths, scratch);
+}
+
+void Camera::intersectPaths(const PathQueue& paths, const Hittable& world, std::vector<HitRecord>& hits,
+    std::vector<char>& isHit, bool primary) const {
+
+    hits.resize(paths.size());
+    isHit.resize(paths.size());
+
+    //  Camera rays go through the scene in packets, which share their traversal of the BVH.
+    //  Bounced rays have lost that coherence and are traced one by one.
+    if (primary && packet_size > 0 && max_depth > 0) {
+        int packetRays = packet_size * packet_size;
+        std::vector<double> tMax(packetRays);
+
+        for (int first = 0; first < paths.size(); first += packetRays) {
+            int count = paths.size() - first < packetRays ? paths.size() - first : packetRays;
+            for (int i = 0; i < count; ++i) {
+                tMax[i] = Util::infinity;
+                isHit[first + i] = false;
+            }
+            world.hit_packet(&paths.rays[first], count, 0, tMax.data(), &hits[first], &isHit[first]);
+        }
+
+        rayCount += paths.size();
+        for (int i = 0; i < paths.size(); ++i)
+            if (isHit[i])
+                hits[i].compute_differentials(paths.ray_differential(i));
+        return;
+    }
+
+    for (int i = 0; i < paths.size(); ++i) {
+        //  Paths out of bounces are not traced, rayColor returns white for them
+        if (paths.depth[i] <= 0) {
+            isHit[i] = false;
+            continue;
+        }
+
+        ++rayCount;
+        isHit[i] = world.hit(paths.rays[i], interval(0, Util::infinity), hits[i]);
+        if (isHit[i])
+            hits[i].compute_differentials(paths.ray_differential(i));
+    }
+}
+
+void Camera::shadePaths(const PathQueue& paths, const std::vector<HitRecord>& hits, const std::vector<char>& isHit,
+    std::vector<pixel_sum>& image, PathQueue& nextPaths, ShadowQueue& shadows) const {
+
+    //  Paths that end here, and emission of the surfaces hit
+    std::vector<int> surfaceLanes;
+    for (int i = 0; i < paths.size(); ++i) {
+        const ray& r = paths.rays[i];
+        double misWeight = 1;
+
+        if (paths.depth[i] <= 0) {
+            image[paths.pixel[i]] += paths.throughput[i];
+            continue;
+        }
+
+        if (paths.scatterPdf[i] > 0)
+            misWeight = powerHeuristic(paths.scatterPdf[i], lightPdf(r.origin(), r.direction()));
+
+        if (!isHit[i]) {
+            image[paths.pixel[i]] += paths.throughput[i] * environmentColor(r) * misWeight;
+            continue;
+        }
+
+        const HitRecord& rec = hits[i];
+        color emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        if (!emission.near_zero())
+            image[paths.pixel[i]] += paths.throughput[i] * emission * misWeight;
+
+        surfaceLanes.push_back(i);
+    }
+
+    //  Albedos of every textured hit, texture by texture
+    AlbedoBatch albedos;
+    std::vector<int> albedoLane(paths.size(), -1);
+    for (int i : surfaceLanes)
+        albedoLane[i] = albedos.add(hits[i]);
+
+    std::vector<color> albedoValues;
+    albedos.evaluate(albedoValues);
+
+    //  Scattering, material by material
+    std::stable_sort(surfaceLanes.begin(), surfaceLanes.end(), [&hits](int a, int b) {
+        return std::less<const material*>()(hits[a].mat.get(), hits[b].mat.get());
+    });
+
+    ScatteredRays scattered;
+    for (int i : surfaceLanes) {
+        RayDifferential r = paths.ray_differential(i);
+        const HitRecord& rec = hits[i];
+        color attenuation;
+
+        bool isScattered = albedoLane[i] >= 0
+            ? rec.mat->scatter_with_albedo(r, rec, albedoValues[albedoLane[i]], attenuation, scattered)
+            : rec.mat->scatter(r, rec, attenuation, scattered);
+        if (!isScattered)
+            continue;
+
+        for (const ScatteredRay& s : scattered) {
+            double pdf = hasLightSampling() ? rec.mat->scattering_pdf(r, rec, s.r) : 0;
+            color weight = paths.throughput[i] * s.coeff * attenuation;
+            nextPaths.push(s.r, weight, paths.pixel[i], paths.depth[i] - 1, pdf);
+
+            ray shadowRay;
+            double lightWeight;
+            if (pdf > 0 && sampleLightRay(r, rec, shadowRay, lightWeight))
+                shadows.push(shadowRay, weight * lightWeight, paths.pixel[i]);
+        }
+    }
+}
+
+void Camera::traceShadows(const ShadowQueue& shadows, const Hittable& world, std::vector<pixel_sum>& image) const {
+    for (int i = 0; i < shadows.size(); ++i)
+        image[shadows.pixel[i]] += shadows.weight[i] * incomingEmission(shadows.rays[i], world);
+}
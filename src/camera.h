@@ -12,14 +12,21 @@
 //==============================================================================================
 
 #include <iostream>
+#include <vector>
 
 #include "common.h"
 #include "material.h"
 
 #include "hittable/hittable.h"
+#include "environment.h"
+#include "hittable/lightBvh.h"
 
 enum class SamplingMethod { Normal, SuperSampling, AdaptiveSuperSampling };
 
+//  Recursive : one path at a time, depth first through rayColor
+//  Wavefront : all paths of a batch of pixels advance together, one stage at a time
+enum class RenderMode { Recursive, Wavefront };
+
 class Camera {
 public:
     double aspect_ratio = 1.0;  // Ratio of image width over height
@@ -27,6 +34,7 @@ public:
     int    samples_per_pixel = 10;   // Count of random samples for each pixel
     int    max_depth = 10;   // Maximum number of ray bounces into scene
     color  background;               // Scene background color
+    shared_ptr<EnvironmentLight> environment; // Replaces `background` when set, and is sampled as a light
 
     double vfov = 90;              // Vertical view angle (field of view)
     point3 lookfrom = point3(0, 0, -1);  // Point camera is looking from
@@ -40,8 +48,19 @@ public:
 
     SamplingMethod samplingMethod = SamplingMethod::SuperSampling;
 
+    RenderMode renderMode = RenderMode::Recursive;
+    int    wavefront_size = 1 << 16;  // Paths started per wavefront batch
+    bool   sort_rays = false;         // Reorder wavefront rays by direction and origin before tracing
+    int    packet_size = 8;           // Side in pixels of the wavefront's primary ray packets, 0 for single rays
+
     void render(std::ostream& out, const Hittable& world);
 
+    //  Render with next event estimation : diffuse hits also sample `lights` directly
+    void render(std::ostream& out, const Hittable& world, const LightBvh& lights);
+
+    //  Rays traced by the last render, camera, scattered and shadow rays alike
+    size_t rays_traced() const { return rayCount; }
+
 private:
     int    image_height;   // Rendered image height
     point3 center;         // Camera center
@@ -53,12 +72,83 @@ private:
     vec3   defocus_disk_u;  // Defocus disk horizontal radius
     vec3   defocus_disk_v;  // Defocus disk vertical radius
 
+    const LightBvh* lights = nullptr; // Emitters sampled at each diffuse hit, if any
+
+    mutable size_t rayCount = 0;
+
+    //  Paths in flight in the wavefront integrator, one lane per path
+    struct PathQueue {
+        std::vector<ray> rays;
+        std::vector<color> throughput;     // Weight of the path's radiance in its pixel
+        std::vector<int> pixel;
+        std::vector<int> depth;            // Bounces left
+        std::vector<double> scatterPdf;    // As in rayColor
+        std::vector<int> differential;     // Index of the path's ray in differentials, -1 if it has none
+
+        //  Rays of the paths that still carry differentials, camera rays and specular bounces :
+        //  traversal and sorting only touch the plain rays
+        std::vector<RayDifferential> differentials;
+
+        int size() const { return static_cast<int>(rays.size()); }
+
+        void clear() {
+            rays.clear(); throughput.clear(); pixel.clear(); depth.clear(); scatterPdf.clear();
+            differential.clear(); differentials.clear();
+        }
+
+        void push(const RayDifferential& r, const color& weight, int pixelIndex, int depthLeft, double pdf) {
+            rays.push_back(r);
+            throughput.push_back(weight);
+            pixel.push_back(pixelIndex);
+            depth.push_back(depthLeft);
+            scatterPdf.push_back(pdf);
+            differential.push_back(r.has_differentials() ? static_cast<int>(differentials.size()) : -1);
+            if (r.has_differentials())
+                differentials.push_back(r);
+        }
+
+        RayDifferential ray_differential(int i) const {
+            return differential[i] < 0 ? RayDifferential(rays[i]) : differentials[differential[i]];
+        }
+    };
+
+    //  Light samples waiting for their visibility test
+    struct ShadowQueue {
+        std::vector<ray> rays;
+        std::vector<color> weight;
+        std::vector<int> pixel;
+
+        int size() const { return static_cast<int>(rays.size()); }
+
+        void clear() { rays.clear(); weight.clear(); pixel.clear(); }
+
+        void push(const ray& r, const color& w, int pixelIndex) {
+            rays.push_back(r);
+            weight.push_back(w);
+            pixel.push_back(pixelIndex);
+        }
+    };
 
     void initialize();
 
-    color rayColor(const ray& r, int depth, const Hittable& world) const;
+    //  scatterPdf : solid angle density the ray was sampled with, 0 if it was not sampled from a pdf
+    color rayColor(const RayDifferential& r, int depth, const Hittable& world, double scatterPdf = 0) const;
+
+    color sampleLights(const ray& rIn, const HitRecord& rec, const Hittable& world) const;
+
+    //  Light sample of sampleLights before its visibility test : emission along `shadowRay`
+    //  times `weight` is the estimate. False when the sample contributes nothing.
+    bool sampleLightRay(const ray& rIn, const HitRecord& rec, ray& shadowRay, double& weight) const;
+
+    double lightPdf(const point3& origin, const vec3& direction) const;
+
+    color incomingEmission(const ray& r, const Hittable& world) const;
 
-    ray getRayWithSamplePos(point3 pixel_sample) const {
+    color environmentColor(const ray& r) const;
+
+    bool hasLightSampling() const { return lights != nullptr || environment != nullptr; }
+
+    RayDifferential getRayWithSamplePos(point3 pixel_sample) const {
        
         auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
 
@@ -66,10 +156,13 @@ private:
 
         auto ray_time = shutter_duration * Util::random_double();
 
-        return ray(ray_origin, ray_direction, ray_time);
+        //  Neighbouring pixels' rays, for texture filtering
+        RayDifferential r(ray(ray_origin, ray_direction, ray_time));
+        r.set_differentials(ray_origin, ray_direction + pixel_delta_u, ray_origin, ray_direction + pixel_delta_v);
+        return r;
     }
 
-    ray getRay(int i, int j) const {
+    RayDifferential getRay(int i, int j) const {
         // Get a randomly-sampled camera ray for the pixel at location i,j, originating from
         // the camera defocus disk.
 
@@ -91,6 +184,21 @@ private:
         const color(&cornersColor)[4]);
 
     void adaptiveSuperSampling(const Hittable& world, unsigned int i, unsigned int j, color& pixelColor);
+
+    //  Wavefront integrator stages, see renderWavefront
+    void renderWavefront(std::ostream& out, const Hittable& world);
+
+    void generatePaths(int firstPixel, int numPixels, int samples, PathQueue& paths) const;
+
+    void sortPaths(PathQueue& paths, PathQueue& scratch) const;
+
+    void intersectPaths(const PathQueue& paths, const Hittable& world, std::vector<HitRecord>& hits,
+        std::vector<char>& isHit, bool primary) const;
+
+    void shadePaths(const PathQueue& paths, const std::vector<HitRecord>& hits, const std::vector<char>& isHit,
+        std::vector<pixel_sum>& image, PathQueue& nextPaths, ShadowQueue& shadows) const;
+
+    void traceShadows(const ShadowQueue& shadows, const Hittable& world, std::vector<pixel_sum>& image) const;
 };
 
 
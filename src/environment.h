@@ -0,0 +1,173 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#include "tool/image.h"
+
+/*
+    Piecewise constant 2D distribution over the pixels of a lat-long environment map, weighted by
+    luminance * sin(theta) so that sampling is proportional to the light arriving per solid angle.
+    Rows are chosen from the marginal CDF then a column from that row's conditional CDF, both by
+    binary search.
+*/
+class EnvironmentDistribution {
+public:
+    int width = 0, height = 0;
+    std::vector<float> pixels;             // Linear RGB, row major, top row first
+
+    EnvironmentDistribution(const char* filename) {
+        if (!Image::load_linear(filename, pixels, width, height))
+            return;
+
+        conditionalCdf.resize(static_cast<size_t>(height) * (width + 1));
+        rowIntegral.resize(height);
+        marginalCdf.resize(height + 1);
+
+        for (int j = 0; j < height; ++j) {
+            double sinTheta = sin(Util::pi * (j + 0.5) / height);
+            double* cdf = &conditionalCdf[static_cast<size_t>(j) * (width + 1)];
+
+            cdf[0] = 0;
+            for (int i = 0; i < width; ++i)
+                cdf[i + 1] = cdf[i] + luminance(texel(i, j)) * sinTheta;
+
+            rowIntegral[j] = cdf[width] / width;
+            for (int i = 1; i <= width; ++i)
+                cdf[i] = cdf[width] > 0 ? cdf[i] / cdf[width] : static_cast<double>(i) / width;
+        }
+
+        marginalCdf[0] = 0;
+        for (int j = 0; j < height; ++j)
+            marginalCdf[j + 1] = marginalCdf[j] + rowIntegral[j];
+
+        integral = marginalCdf[height] / height;
+        for (int j = 1; j <= height; ++j)
+            marginalCdf[j] = integral > 0 ? marginalCdf[j] / marginalCdf[height] : static_cast<double>(j) / height;
+    }
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    color texel(int i, int j) const {
+        const float* p = &pixels[(static_cast<size_t>(j) * width + i) * 3];
+        return color(p[0], p[1], p[2]);
+    }
+
+    //  Sample a texel proportionally to its weight and return a continuous (u, v) inside it
+    double sample(double& u, double& v) const {
+        int j = find_interval(marginalCdf.data(), height, Util::random_double());
+        const double* cdf = &conditionalCdf[static_cast<size_t>(j) * (width + 1)];
+        int i = find_interval(cdf, width, Util::random_double());
+
+        u = (i + Util::random_double()) / width;
+        v = (j + Util::random_double()) / height;
+        return pdf(i, j);
+    }
+
+    //  Density of `sample` over [0,1]^2 for the texel i, j
+    double pdf(int i, int j) const {
+        if (integral <= 0)
+            return 1.0;
+        double sinTheta = sin(Util::pi * (j + 0.5) / height);
+        return luminance(texel(i, j)) * sinTheta / integral;
+    }
+
+    //  Maps are shared by file name, so the tables are built once no matter how many frames or
+    //  lights use them
+    static shared_ptr<EnvironmentDistribution> load(const std::string& filename) {
+        static std::map<std::string, shared_ptr<EnvironmentDistribution>> cache;
+
+        auto it = cache.find(filename);
+        if (it != cache.end())
+            return it->second;
+
+        auto distribution = make_shared<EnvironmentDistribution>(filename.c_str());
+        cache[filename] = distribution;
+        return distribution;
+    }
+
+private:
+    std::vector<double> conditionalCdf;    // height rows of (width + 1) entries
+    std::vector<double> marginalCdf;       // height + 1 entries
+    std::vector<double> rowIntegral;
+    double integral = 0;
+
+    static int find_interval(const double* cdf, int size, double x) {
+        // Index i such that cdf[i] <= x < cdf[i + 1], skipping zero width intervals.
+        int i = static_cast<int>(std::upper_bound(cdf, cdf + size + 1, x) - cdf) - 1;
+        return Util::clamp(i, 0, size - 1);
+    }
+};
+
+/*
+    Infinitely far light surrounding the scene, read from a lat-long (equirectangular) image using
+    the same (u, v) convention as Sphere::get_sphere_uv.
+*/
+class EnvironmentLight {
+public:
+    EnvironmentLight(const char* filename, double _intensity = 1.0)
+        : distribution(EnvironmentDistribution::load(filename)), intensity(_intensity) {}
+
+    bool empty() const { return distribution->empty(); }
+
+    color value(const vec3& direction) const {
+        if (empty()) return color(0, 0, 0);
+
+        int i, j;
+        to_texel(unit_vector(direction), i, j);
+        return intensity * distribution->texel(i, j);
+    }
+
+    vec3 random() const {
+        if (empty()) return vec3(0, 1, 0);
+
+        double u, v;
+        distribution->sample(u, v);
+        return from_uv(u, v);
+    }
+
+    double pdf_value(const vec3& direction) const {
+        if (empty()) return 0;
+
+        vec3 d = unit_vector(direction);
+        int i, j;
+        to_texel(d, i, j);
+
+        double sinTheta = sqrt(fmax(0.0, 1 - d.y() * d.y()));
+        if (sinTheta <= 0)
+            return 0;
+
+        //  Jacobian from [0,1]^2 to the sphere : du dv = dw / (2 pi^2 sin(theta))
+        return distribution->pdf(i, j) / (2 * Util::pi * Util::pi * sinTheta);
+    }
+
+private:
+    shared_ptr<EnvironmentDistribution> distribution;
+    double intensity;
+
+    void to_texel(const vec3& d, int& i, int& j) const {
+        auto theta = acos(Util::clamp(-d.y(), -1.0, 1.0));
+        auto phi = atan2(-d.z(), d.x()) + Util::pi;
+
+        double u = phi * Util::invPi / 2.0;
+        double v = theta * Util::invPi;
+
+        //  Images are stored top row first
+        i = Util::clamp(static_cast<int>(u * distribution->width), 0, distribution->width - 1);
+        j = Util::clamp(static_cast<int>((1 - v) * distribution->height), 0, distribution->height - 1);
+    }
+
+    vec3 from_uv(double u, double row) const {
+        // `row` goes from the top of the image (0) to the bottom (1).
+        double theta = (1 - row) * Util::pi;
+        double phi = 2 * Util::pi * u;
+        return vec3(-cos(phi) * sin(theta), -cos(theta), sin(phi) * sin(theta));
+    }
+};
+
+#endif
@@ -1,51 +1,146 @@
 #ifndef AABB_H
 #define AABB_H
 
+#include <utility>
+
 #include "../common.h"
+#include "../math/vec4.h"
 
-class aabb {
+template <typename T>
+class basic_aabb {
 public:
-    interval x, y, z;
+    basic_interval<T> x, y, z;
 
-    aabb() {} // The default AABB is empty, since intervals are empty by default.
+    basic_aabb() {} // The default AABB is empty, since intervals are empty by default.
 
-    aabb(const interval& ix, const interval& iy, const interval& iz)
+    basic_aabb(const basic_interval<T>& ix, const basic_interval<T>& iy, const basic_interval<T>& iz)
         : x(ix), y(iy), z(iz) { }
 
-    aabb(const point3& a, const point3& b) {
+    basic_aabb(const basic_vec3<T>& a, const basic_vec3<T>& b) {
         // Treat the two points a and b as extrema for the bounding box, so we don't require a
         // particular minimum/maximum coordinate order.
-        x = interval(fmin(a[0], b[0]), fmax(a[0], b[0]));
-        y = interval(fmin(a[1], b[1]), fmax(a[1], b[1]));
-        z = interval(fmin(a[2], b[2]), fmax(a[2], b[2]));
+        x = basic_interval<T>(fmin(a[0], b[0]), fmax(a[0], b[0]));
+        y = basic_interval<T>(fmin(a[1], b[1]), fmax(a[1], b[1]));
+        z = basic_interval<T>(fmin(a[2], b[2]), fmax(a[2], b[2]));
     }
 
-    aabb(const aabb& box0, const aabb& box1) {
-        x = interval(box0.x, box1.x);
-        y = interval(box0.y, box1.y);
-        z = interval(box0.z, box1.z);
+    basic_aabb(const basic_aabb& box0, const basic_aabb& box1) {
+        x = basic_interval<T>(box0.x, box1.x);
+        y = basic_interval<T>(box0.y, box1.y);
+        z = basic_interval<T>(box0.z, box1.z);
     }
 
-    const interval& axis(int n) const {
+    const basic_interval<T>& axis(int n) const {
         if (n == 1) return y;
         if (n == 2) return z;
         return x;
     }
 
-    bool hit(const ray& r, interval rayT) const {
+    //  0 for empty boxes
+    T surface_area() const {
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+        return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
+    //  Slab test : `inside` is narrowed to the part of the ray within the box, and the axes of the
+    //  faces the ray enters and leaves through are returned along with it
+    bool hit_slabs(const basic_ray<T>& r, basic_interval<T>& inside, int& entryAxis, int& exitAxis) const {
+        entryAxis = exitAxis = 0;
+        for (int a = 0; a < 3; ++a) {
+            auto invD = 1 / r.direction()[a];
+            auto t0 = (axis(a).min - r.origin()[a]) * invD;
+            auto t1 = (axis(a).max - r.origin()[a]) * invD;
+            if (invD < 0)
+                std::swap(t0, t1);
+
+            if (t0 > inside.min) {
+                inside.min = t0;
+                entryAxis = a;
+            }
+            if (t1 < inside.max) {
+                inside.max = t1;
+                exitAxis = a;
+            }
+            if (inside.max <= inside.min)
+                return false;
+        }
+        return true;
+    }
+
+    //  The three slabs side by side in one register, the 4th lane carries rayT itself. min/max
+    //  hand back their 2nd operand on NaN (0 * inf), which drops that slab as fmin/fmax did.
+    bool hit(const basic_ray<T>& r, basic_interval<T> rayT) const {
+        typedef Simd::Lanes<T> L;
+        const auto& o = r.origin();
+        const auto& d = r.direction();
+        auto origin = L::set(o.x(), o.y(), o.z(), 0);
+        auto invD = L::div(L::splat(1), L::set(d.x(), d.y(), d.z(), 1));
+        auto t0 = L::mul(L::sub(L::set(x.min, y.min, z.min, rayT.min), origin), invD);
+        auto t1 = L::mul(L::sub(L::set(x.max, y.max, z.max, rayT.max), origin), invD);
+
+        T tNear = L::hmax(L::max(L::min(t0, t1), L::splat(rayT.min)));
+        T tFar = L::hmin(L::min(L::max(t0, t1), L::splat(rayT.max)));
+        return tNear < tFar;
+    }
+};
+
+using aabb = basic_aabb<Util::Real>;
+
+/*
+    Bounds of a packet of rays : the intervals spanned by their origins and by the inverses of
+    their directions. Box tests done in interval arithmetic over them are conservative for the
+    whole packet, a box they reject is missed by every ray.
+*/
+class PacketBounds {
+public:
+    PacketBounds(const ray* rays, int count) {
         for (int a = 0; a < 3; ++a) {
-            auto t0 = fmin((axis(a).min - r.origin()[a]) / r.direction()[a],
-                (axis(a).max - r.origin()[a]) / r.direction()[a]);
-            auto t1 = fmax((axis(a).min - r.origin()[a]) / r.direction()[a],
-                (axis(a).max - r.origin()[a]) / r.direction()[a]);
-
-            rayT.min = fmax(t0, rayT.min);
-            rayT.max = fmin(t1, rayT.max);
-            if (rayT.max <= rayT.min)
+            double originLo = rays[0].origin()[a], originHi = originLo;
+            double dirLo = rays[0].direction()[a], dirHi = dirLo;
+            for (int i = 1; i < count; ++i) {
+                originLo = fmin(originLo, rays[i].origin()[a]);
+                originHi = fmax(originHi, rays[i].origin()[a]);
+                dirLo = fmin(dirLo, rays[i].direction()[a]);
+                dirHi = fmax(dirHi, rays[i].direction()[a]);
+            }
+
+            //  Directions of mixed (or zero) sign bound nothing along this axis
+            useAxis[a] = dirLo > 0 || dirHi < 0;
+            positive[a] = dirLo > 0;
+            origin[a] = interval(originLo, originHi);
+            invDir[a] = useAxis[a] ? interval(1 / dirHi, 1 / dirLo) : interval();
+        }
+    }
+
+    bool hit(const aabb& box, interval rayT) const {
+        for (int a = 0; a < 3; ++a) {
+            if (!useAxis[a])
+                continue;
+
+            interval t0 = multiply(interval(box.axis(a).min - origin[a].max, box.axis(a).min - origin[a].min), invDir[a]);
+            interval t1 = multiply(interval(box.axis(a).max - origin[a].max, box.axis(a).max - origin[a].min), invDir[a]);
+            const interval& tNear = positive[a] ? t0 : t1;
+            const interval& tFar = positive[a] ? t1 : t0;
+
+            rayT.min = fmax(tNear.min, rayT.min);
+            rayT.max = fmin(tFar.max, rayT.max);
+            if (rayT.max < rayT.min)
                 return false;
         }
         return true;
     }
+
+private:
+    interval origin[3];
+    interval invDir[3];
+    bool useAxis[3];
+    bool positive[3];
+
+    static interval multiply(const interval& a, const interval& b) {
+        double p0 = a.min * b.min, p1 = a.min * b.max, p2 = a.max * b.min, p3 = a.max * b.max;
+        return interval(fmin(fmin(p0, p1), fmin(p2, p3)), fmax(fmax(p0, p1), fmax(p2, p3)));
+    }
 };
 
 #endif
\ No newline at end of file
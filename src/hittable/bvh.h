@@ -2,11 +2,20 @@
 #define BVH_H
 
 #include <algorithm>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
 
 #include "../common.h"
+#include "../math/morton.h"
+#include "../tool/threadPool.h"
 
 #include "Hittable.h"
 #include "HittableList.h"
+#include "flatBvh.h"
 
 
 class bvhNode : public Hittable {
@@ -15,7 +24,130 @@ public:
 
     bvhNode(const std::vector<shared_ptr<Hittable>>& srcObjectVec, size_t start, size_t end) {
         auto objects = srcObjectVec; // Create a modifiable array of the source scene objects
+        build(objects, start, end);
+    }
+
+    //  Linear BVH, built in parallel for fast previews of large scenes : the primitives are sorted
+    //  along a Morton curve through their centroids, and each node splits its range where the
+    //  highest differing bit of their codes flips. Bounds, codes and the sort are spread over
+    //  `pool`, then the subtrees below the top levels are built as independent tasks. The calling
+    //  thread waits on them, so it must not be one of the pool's workers.
+    bvhNode(const HittableList& list, ThreadPool& pool);
+
+    //  Node over two existing subtrees
+    bvhNode(shared_ptr<Hittable> _left, shared_ptr<Hittable> _right) {
+        set_children(_left, _right);
+    }
+
+    //  Flat form of the tree, for BvhCache : FlatNodes in depth first order from this one, node i's
+    //  bounds in bounds[i], and the leaves' items in items as indices into the list of objects
+    //  the tree was built over. Each inner node splits along the axis its children's centers are
+    //  furthest apart on.
+    void flatten(const std::vector<shared_ptr<Hittable>>& objects, std::vector<aabb>& bounds,
+        std::vector<FlatNode>& nodes, std::vector<int32_t>& items) const {
+        std::unordered_map<const Hittable*, int32_t> objectIndex;
+        for (size_t i = 0; i < objects.size(); ++i)
+            objectIndex[objects[i].get()] = static_cast<int32_t>(i);
+
+        bounds.clear();
+        nodes.clear();
+        items.clear();
+        flatten(objectIndex, bounds, nodes, items);
+    }
+
+    //  Updates the bounds bottom up after primitives moved, keeping the tree as it was built.
+    //  Linear in the node count, but the tree gets worse as primitives stray from their
+    //  build time neighbours : see sah_cost.
+    void refit() {
+        if (leftIsNode)
+            static_cast<bvhNode*>(left.get())->refit();
+        if (rightIsNode && right != left)
+            static_cast<bvhNode*>(right.get())->refit();
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+    }
+
+    //  Expected cost of tracing a ray through the tree by the surface area heuristic : every
+    //  node's traversal and its primitives' intersections, weighted by the probability (surface
+    //  area over the root's) that a ray through the root reaches them
+    double sah_cost() const {
+        double rootArea = bbox.surface_area();
+        return rootArea > 0 ? sah_area_cost() / rootArea : 0.0;
+    }
+
+    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        if (!bbox.hit(r, rayT))
+            return false;
+        
+        bool hit_left = left->hit(r, rayT, rec);
+
+        bool hit_right = right->hit(r, interval(rayT.min, hit_left ? rec.t : rayT.max), rec);
+
+        return hit_left || hit_right;
+    }
 
+    //  One interval arithmetic test over the whole packet decides whether any of its rays can
+    //  reach a node, the nodes are walked from a stack shared by all of them
+    void hit_packet(const ray* rays, int count, double tMin, double* tMax, HitRecord* recs,
+        char* isHit) const override {
+        PacketBounds packet(rays, count);
+
+        const bvhNode* stack[maxPacketStack];
+        int top = 0;
+        stack[top++] = this;
+
+        while (top > 0) {
+            const bvhNode* node = stack[--top];
+
+            double farthest = tMax[0];
+            for (int i = 1; i < count; ++i)
+                farthest = fmax(farthest, tMax[i]);
+            if (!packet.hit(node->bbox, interval(tMin, farthest)))
+                continue;
+
+            //  Primitives right away, inner nodes onto the stack (right first so left pops first)
+            const Hittable* children[2] = { node->right.get(), node->left.get() };
+            bool childIsNode[2] = { node->rightIsNode, node->leftIsNode };
+            int numChildren = node->left == node->right ? 1 : 2;
+            for (int c = 2 - numChildren; c < 2; ++c) {
+                if (childIsNode[c] && top < maxPacketStack)
+                    stack[top++] = static_cast<const bvhNode*>(children[c]);
+                else
+                    children[c]->hit_packet(rays, count, tMin, tMax, recs, isHit);
+            }
+        }
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        if (!bbox.hit(r, rayT))
+            return 1.0;
+
+        double result = left->transmittance(r, rayT);
+        if (result <= 0.0 || left == right)
+            return result;
+
+        return result * right->transmittance(r, rayT);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    //  A single object is both children
+    void children(std::vector<shared_ptr<Hittable>>& parts,
+        std::vector<shared_ptr<Hittable>>& /*transformed*/) const override {
+        parts.push_back(left);
+        if (right != left)
+            parts.push_back(right);
+    }
+
+    //  Tag of the constructor building over `objects` without copying it
+    struct InPlace {};
+
+    bvhNode(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end, InPlace) {
+        build(objects, start, end);
+    }
+
+private:
+    //  Sorts the ranges of `objects` in place, children share the parent's array
+    void build(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end) {
         int axis = Util::random_int(0, 2);
         auto comparator = (axis == 0) ? box_x_compare
             : (axis == 1) ? box_y_compare
@@ -40,30 +172,171 @@ public:
             std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
             auto mid = start + object_span / 2;
-            left = make_shared<bvhNode>(objects, start, mid);
-            right = make_shared<bvhNode>(objects, mid, end);
+            left = make_shared<bvhNode>(objects, start, mid, InPlace());
+            right = make_shared<bvhNode>(objects, mid, end, InPlace());
         }
 
+        set_children(left, right);
+    }
+
+    void set_children(shared_ptr<Hittable> _left, shared_ptr<Hittable> _right) {
+        left = _left;
+        right = _right;
         bbox = aabb(left->bounding_box(), right->bounding_box());
+        leftIsNode = dynamic_cast<bvhNode*>(left.get()) != nullptr;
+        rightIsNode = dynamic_cast<bvhNode*>(right.get()) != nullptr;
     }
 
-    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
-        if (!bbox.hit(r, rayT))
-            return false;
-        
-        bool hit_left = left->hit(r, rayT, rec);
+    //  Primitive of the linear BVH build, by the Morton code of its centroid
+    struct MortonPrimitive {
+        uint32_t code;
+        size_t index;
 
-        bool hit_right = right->hit(r, interval(rayT.min, hit_left ? rec.t : rayT.max), rec);
+        bool operator<(const MortonPrimitive& other) const { return code < other.code; }
+    };
 
-        return hit_left || hit_right;
+    //  Index splitting primitives[start, end) (sorted by code, at least 2 of them) where the
+    //  highest bit differing between its first and last codes flips, the middle if they are equal
+    static size_t morton_split(const std::vector<MortonPrimitive>& primitives, size_t start, size_t end) {
+        uint32_t differing = primitives[start].code ^ primitives[end - 1].code;
+        if (differing == 0)
+            return start + (end - start) / 2;
+
+        uint32_t bit = 1u << 31;
+        while ((differing & bit) == 0)
+            bit >>= 1;
+        return std::partition_point(primitives.begin() + start, primitives.begin() + end,
+            [bit](const MortonPrimitive& p) { return (p.code & bit) == 0; }) - primitives.begin();
     }
 
-    aabb bounding_box() const override { return bbox; }
+    //  Subtree over primitives[start, end), a lone primitive is its own subtree
+    static shared_ptr<Hittable> build_morton(const std::vector<shared_ptr<Hittable>>& objects,
+        const std::vector<MortonPrimitive>& primitives, size_t start, size_t end) {
+        if (end - start == 1)
+            return objects[primitives[start].index];
+
+        size_t mid = morton_split(primitives, start, end);
+        return make_shared<bvhNode>(build_morton(objects, primitives, start, mid),
+            build_morton(objects, primitives, mid, end));
+    }
+
+    //  Ranges of the subtrees built as tasks : the top levels are split until ranges hold at most
+    //  `grain` primitives. assemble_morton walks the same splits afterwards.
+    static void morton_task_ranges(const std::vector<MortonPrimitive>& primitives, size_t start, size_t end,
+        size_t grain, std::vector<std::pair<size_t, size_t>>& ranges) {
+        if (end - start <= grain) {
+            ranges.push_back({ start, end });
+            return;
+        }
+        size_t mid = morton_split(primitives, start, end);
+        morton_task_ranges(primitives, start, mid, grain, ranges);
+        morton_task_ranges(primitives, mid, end, grain, ranges);
+    }
+
+    static shared_ptr<Hittable> assemble_morton(const std::vector<MortonPrimitive>& primitives, size_t start,
+        size_t end, size_t grain, std::vector<std::future<shared_ptr<Hittable>>>& subtrees, size_t& next) {
+        if (end - start <= grain)
+            return subtrees[next++].get();
+
+        size_t mid = morton_split(primitives, start, end);
+        auto leftTree = assemble_morton(primitives, start, mid, grain, subtrees, next);
+        return make_shared<bvhNode>(leftTree, assemble_morton(primitives, mid, end, grain, subtrees, next));
+    }
+
+    //  Runs body(begin, end) over chunks of [0, count) on `pool`, and waits for all of them
+    template <typename F>
+    static void parallel_for(ThreadPool& pool, size_t count, F body) {
+        size_t chunks = std::min(count, 4 * pool.size());
+        std::vector<std::future<void>> done;
+        for (size_t c = 0; c < chunks; ++c)
+            done.push_back(pool.submit([=] { body(count * c / chunks, count * (c + 1) / chunks); }));
+        for (auto& d : done)
+            d.get();
+    }
+
+    static const int maxPacketStack = 64;
+    static constexpr double traversalCost = 1;    // SAH cost of a node's box test
+    static constexpr double intersectionCost = 1; // SAH cost of a primitive's hit
 
-private:
     shared_ptr<Hittable> left;
     shared_ptr<Hittable> right;
     aabb bbox;
+    bool leftIsNode, rightIsNode;
+
+    //  Appends this node and its subtree, returns this node's index
+    int32_t flatten(const std::unordered_map<const Hittable*, int32_t>& objectIndex, std::vector<aabb>& bounds,
+        std::vector<FlatNode>& nodes, std::vector<int32_t>& items) const {
+        int32_t index = static_cast<int32_t>(nodes.size());
+        bounds.push_back(bbox);
+        nodes.push_back(FlatNode());
+
+        //  Objects first : a list's objects can be bvhNodes themselves
+        const Hittable* pair[2] = { left.get(), right.get() };
+        bool isNode[2] = { leftIsNode, rightIsNode };
+        int32_t object[2];
+        for (int c = 0; c < 2; ++c) {
+            auto found = objectIndex.find(pair[c]);
+            object[c] = found != objectIndex.end() ? found->second : -1;
+            if (object[c] < 0 && !isNode[c])
+                throw std::runtime_error("BVH not built over these objects");
+        }
+
+        if (object[0] >= 0 && object[1] >= 0) {
+            nodes[index] = FlatNode{ static_cast<int32_t>(items.size()), left == right ? 1 : 2, 0 };
+            items.push_back(object[0]);
+            if (left != right)
+                items.push_back(object[1]);
+            return index;
+        }
+
+        //  The child on the low side of the axis goes first, right after this node
+        point3 center[2];
+        for (int c = 0; c < 2; ++c) {
+            aabb box = pair[c]->bounding_box();
+            center[c] = point3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max);
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; ++a)
+            if (fabs(center[1][a] - center[0][a]) > fabs(center[1][axis] - center[0][axis]))
+                axis = a;
+        int order[2] = { 0, 1 };
+        if (center[1][axis] < center[0][axis])
+            std::swap(order[0], order[1]);
+
+        int32_t second = 0;
+        for (int c : order) {
+            int32_t child;
+            if (object[c] >= 0) {
+                //  Object beside a subtree, in a leaf of its own
+                child = static_cast<int32_t>(nodes.size());
+                bounds.push_back(pair[c]->bounding_box());
+                nodes.push_back(FlatNode{ static_cast<int32_t>(items.size()), 1, 0 });
+                items.push_back(object[c]);
+            }
+            else
+                child = static_cast<const bvhNode*>(pair[c])->flatten(objectIndex, bounds, nodes, items);
+            second = child;
+        }
+        nodes[index] = FlatNode{ second, 0, axis };
+        return index;
+    }
+
+    //  sah_cost before its division by the root's area
+    double sah_area_cost() const {
+        int primitives = 0;
+        double children = 0;
+        if (leftIsNode)
+            children += static_cast<const bvhNode*>(left.get())->sah_area_cost();
+        else
+            ++primitives;
+        if (right != left) {
+            if (rightIsNode)
+                children += static_cast<const bvhNode*>(right.get())->sah_area_cost();
+            else
+                ++primitives;
+        }
+        return bbox.surface_area() * (traversalCost + primitives * intersectionCost) + children;
+    }
 
     static bool box_compare(
         const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int axisIndex
@@ -84,4 +357,143 @@ private:
     }
 };
 
+inline bvhNode::bvhNode(const HittableList& list, ThreadPool& pool) {
+    const auto& objects = list.objects;
+    size_t count = objects.size();
+    if (count == 0)
+        throw std::runtime_error("bvhNode over an empty list");
+    if (count <= 2) {
+        auto copy = objects;
+        build(copy, 0, count);
+        return;
+    }
+
+    //  Centroids and their bounds, each chunk reducing its own part before adding it in
+    std::vector<point3> centroids(count);
+    aabb bounds;
+    std::mutex boundsMutex;
+    parallel_for(pool, count, [&](size_t begin, size_t end) {
+        aabb chunkBounds;
+        for (size_t i = begin; i < end; ++i) {
+            aabb box = objects[i]->bounding_box();
+            centroids[i] = point3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max) / 2;
+            chunkBounds = aabb(chunkBounds, aabb(centroids[i], centroids[i]));
+        }
+        std::lock_guard<std::mutex> lock(boundsMutex);
+        bounds = aabb(bounds, chunkBounds);
+    });
+
+    std::vector<MortonPrimitive> primitives(count);
+    vec3 extent(bounds.x.size(), bounds.y.size(), bounds.z.size());
+    parallel_for(pool, count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            vec3 offset = centroids[i] - point3(bounds.x.min, bounds.y.min, bounds.z.min);
+            primitives[i].code = morton3(extent.x() > 0 ? offset.x() / extent.x() : 0,
+                extent.y() > 0 ? offset.y() / extent.y() : 0, extent.z() > 0 ? offset.z() / extent.z() : 0);
+            primitives[i].index = i;
+        }
+    });
+
+    //  Chunks sorted in parallel, then merged pairwise, each round's merges in parallel
+    size_t chunks = std::min(count, 4 * pool.size());
+    std::vector<size_t> cuts;
+    for (size_t c = 0; c <= chunks; ++c)
+        cuts.push_back(count * c / chunks);
+    parallel_for(pool, chunks, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c)
+            std::sort(primitives.begin() + cuts[c], primitives.begin() + cuts[c + 1]);
+    });
+    for (size_t width = 1; width < chunks; width *= 2) {
+        size_t merges = (chunks + 2 * width - 1) / (2 * width);
+        parallel_for(pool, merges, [&](size_t begin, size_t end) {
+            for (size_t m = begin; m < end; ++m) {
+                size_t first = 2 * width * m, middle = std::min(first + width, chunks), last = std::min(first + 2 * width, chunks);
+                std::inplace_merge(primitives.begin() + cuts[first], primitives.begin() + cuts[middle],
+                    primitives.begin() + cuts[last]);
+            }
+        });
+    }
+
+    //  Subtrees of about count / (4 x threads) primitives as tasks, the levels above on this thread
+    size_t grain = std::max<size_t>(2, count / (4 * pool.size()));
+    size_t mid = morton_split(primitives, 0, count);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    morton_task_ranges(primitives, 0, mid, grain, ranges);
+    morton_task_ranges(primitives, mid, count, grain, ranges);
+
+    std::vector<std::future<shared_ptr<Hittable>>> subtrees;
+    for (const auto& range : ranges)
+        subtrees.push_back(pool.submit([&objects, &primitives, range] {
+            return build_morton(objects, primitives, range.first, range.second);
+        }));
+
+    size_t next = 0;
+    auto leftTree = assemble_morton(primitives, 0, mid, grain, subtrees, next);
+    set_children(leftTree, assemble_morton(primitives, mid, count, grain, subtrees, next));
+}
+
+/*
+    bvhNode over objects moving between frames. After the objects moved, update() refits the tree
+    in linear time instead of rebuilding it (a sort per level), and watches its SAH cost : once
+    refits have made it more than `maxDegradation` worse than right after the last build, the
+    tree is rebuilt from the objects' current positions.
+*/
+class AnimatedBvh : public Hittable {
+public:
+    AnimatedBvh(const HittableList& list, double _maxDegradation = 0.5)
+        : objects(list.objects), maxDegradation(_maxDegradation) {
+        rebuild();
+    }
+
+    //  True when the tree was rebuilt rather than refit
+    bool update() {
+        root->refit();
+        if (root->sah_cost() <= builtCost * (1 + maxDegradation))
+            return false;
+
+        rebuild();
+        return true;
+    }
+
+    double sah_cost() const { return root->sah_cost(); }
+
+    //  Cost right after the last build, the reference of update
+    double built_sah_cost() const { return builtCost; }
+
+    int rebuild_count() const { return rebuilds; }
+
+    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        return root->hit(r, rayT, rec);
+    }
+
+    void hit_packet(const ray* rays, int count, double tMin, double* tMax, HitRecord* recs,
+        char* isHit) const override {
+        root->hit_packet(rays, count, tMin, tMax, recs, isHit);
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        return root->transmittance(r, rayT);
+    }
+
+    aabb bounding_box() const override { return root->bounding_box(); }
+
+    void children(std::vector<shared_ptr<Hittable>>& parts,
+        std::vector<shared_ptr<Hittable>>& /*transformed*/) const override {
+        parts.insert(parts.end(), objects.begin(), objects.end());
+    }
+
+private:
+    std::vector<shared_ptr<Hittable>> objects;
+    shared_ptr<bvhNode> root;
+    double maxDegradation;
+    double builtCost = 0;
+    int rebuilds = -1;
+
+    void rebuild() {
+        root = make_shared<bvhNode>(objects, 0, objects.size());
+        builtCost = root->sah_cost();
+        ++rebuilds;
+    }
+};
+
 #endif
\ No newline at end of file
@@ -2,60 +2,44 @@
 #define CUBE_H
 
 #include "hittable.h"
-#include "../math/plane.h"
 
 class Cube : public Hittable {
 public:
     Cube(point3 _center, vec3 _size, shared_ptr<material> _material)
         : center(_center), size(_size), mat(_material) {
 
-        //  planes = [ +x, -x, +y, -y, +z, -z ]
-        planes[0] = Plane(center + vec3(size.x() / 2, 0, 0), vec3(-1, 0, 0));
-        planes[1] = Plane(center + vec3(-size.x() / 2, 0, 0), vec3(1, 0, 0));
-
-        planes[2] = Plane(center + vec3(0, size.y() / 2, 0), vec3(0, -1, 0));
-        planes[3] = Plane(center + vec3(0, -size.y() / 2, 0), vec3(0, 1, 0));
-
-        planes[4] = Plane(center + vec3(0, 0, size.z() / 2), vec3(0, 0, -1));
-        planes[5] = Plane(center + vec3(0, 0, -size.z() / 2), vec3(0, 0, 1));
-
         bbox = aabb(_center - _size/2, _center + _size/2);
     }
 
     bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        //  One slab test against the cube's own bounds. The ray hits where it enters the cube, or
+        //  where it leaves it when the entry is out of rayT (e.g. a ray starting inside).
+        interval inside(-Util::infinity, Util::infinity);
+        int entryAxis, exitAxis;
+        if (!bbox.hit_slabs(r, inside, entryAxis, exitAxis))
+            return false;
 
-        //  For each planes, check if ray is intersect or not
-        double tMax = rayT.max;
-        int hitPlaneIndex = -1;
-        point3 intersectPoint;
-        for (unsigned int i = 0; i < 6; ++i) {
-            double t;
-            if (! planes[i].hit_plane(r, interval(rayT.min, tMax), t))
-                continue;
-          
-            intersectPoint = r.at(t);
-
-            // if intersectPoint is on cube surface
-            if (intersectPoint.x() <= planes[0].point.x() + Util::epsilon
-                && intersectPoint.x() >= planes[1].point.x() - Util::epsilon
-                && intersectPoint.y() <= planes[2].point.y() + Util::epsilon
-                && intersectPoint.y() >= planes[3].point.y() - Util::epsilon
-                && intersectPoint.z() <= planes[4].point.z() + Util::epsilon
-                && intersectPoint.z() >= planes[5].point.z() - Util::epsilon) {
-               
-                hitPlaneIndex = i;
-                //  Clamp tMin so that we can get the first (nearest) planes that ray inersects
-                tMax = t;
-            }
+        double t = inside.min;
+        int axis = entryAxis;
+        double side = -1;  // Entry faces look back along the ray, exit faces away from it
+        if (!rayT.surrounds(t)) {
+            t = inside.max;
+            axis = exitAxis;
+            side = 1;
+            if (!rayT.surrounds(t))
+                return false;
         }
 
-        if (hitPlaneIndex == -1)
-            return false;
-        
-        rec.t = tMax;
-        rec.p = intersectPoint;
-        vec3 outward_normal = planes[hitPlaneIndex].normal;
+        vec3 outward_normal(0, 0, 0);
+        outward_normal[axis] = r.direction()[axis] < 0 ? -side : side;
+
+        // The hit is snapped onto the face, only its other two coordinates carry rounding error
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.p[axis] = outward_normal[axis] > 0 ? bbox.axis(axis).max : bbox.axis(axis).min;
         rec.set_face_normal(r, outward_normal);
+        rec.pError = Util::gamma(3) * (abs(r.origin()) + abs(t * r.direction()));
+        rec.pError[axis] = 0;
         rec.mat = mat;
 
         return true;
@@ -63,13 +47,154 @@ public:
 
     aabb bounding_box() const override { return bbox; }
 
+    bool hit_interval(const ray& r, interval rayT, interval& inside) const override {
+        inside = rayT;
+        int entryAxis, exitAxis;
+        return bbox.hit_slabs(r, inside, entryAxis, exitAxis);
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        //  A direction can be generated by sampling either the face it enters or the one it leaves,
+        //  so sum the area density (converted to solid angle) of both crossings ahead of origin
+        interval inside(-Util::infinity, Util::infinity);
+        int axes[2];
+        if (!bbox.hit_slabs(ray(origin, direction, 0.0), inside, axes[0], axes[1]))
+            return 0;
+
+        double pdf = 0;
+        double crossings[2] = { inside.min, inside.max };
+        for (unsigned int i = 0; i < 2; ++i) {
+            if (crossings[i] <= 0)
+                continue;
+
+            auto distanceSquared = crossings[i] * crossings[i] * direction.length_squared();
+            auto cosine = fabs(direction[axes[i]]) / direction.length();
+            if (cosine > Util::epsilon)
+                pdf += distanceSquared / (cosine * area());
+        }
+        return pdf;
+    }
+
+    vec3 random(const point3& origin) const override {
+        //  Pick a face proportionally to its area, then a uniform point on it
+        double faceAreas[3] = { size.y() * size.z(), size.x() * size.z(), size.x() * size.y() };
+        double pick = Util::random_double() * (faceAreas[0] + faceAreas[1] + faceAreas[2]);
+        int axis = pick < faceAreas[0] ? 0 : pick < faceAreas[0] + faceAreas[1] ? 1 : 2;
+
+        vec3 local = vec3::random(-0.5, 0.5) * size;
+        local[axis] = (Util::random_double() < 0.5 ? -0.5 : 0.5) * size[axis];
+
+        return center + local - origin;
+    }
+
+    double area() const override {
+        return 2 * (size.x() * size.y() + size.y() * size.z() + size.x() * size.z());
+    }
+
+    shared_ptr<material> get_material() const override { return mat; }
+
+    //  Up to their sign the face normals are the three axes, within acos(1 / sqrt(3)) of the
+    //  diagonal between them. A flat cube (a panel) only has the normal of its two big faces.
+    double normal_cone(vec3& w) const override {
+        for (int axis = 0; axis < 3; ++axis)
+            if (size[axis] == 0) {
+                w = vec3(0, 0, 0);
+                w[axis] = 1;
+                return 1;
+            }
+        w = unit_vector(vec3(1, 1, 1));
+        return 1 / sqrt(3.0);
+    }
+
 private:
     point3 center;
     vec3 size;
     shared_ptr<material> mat;
-    Plane planes[6];
     aabb bbox;
 };
 
+/*
+    Box of any orientation : rays are moved into the box's own frame, where it is an axis aligned
+    Cube centered on the origin, and hits moved back. The frame is a rotation, so distances (and
+    the ray parameter t) are the same in both.
+*/
+class OrientedCube : public Hittable {
+public:
+    //  `xAxis` and `yAxis` give the directions of the box's local x and y edges, they are made
+    //  orthonormal (yAxis adjusted to xAxis) and z completes them
+    OrientedCube(point3 _center, vec3 _size, const vec3& xAxis, const vec3& yAxis, shared_ptr<material> _material)
+        : center(_center), box(point3(0, 0, 0), _size, _material) {
+
+        axes[0] = unit_vector(xAxis);
+        axes[1] = unit_vector(yAxis - dot(yAxis, axes[0]) * axes[0]);
+        axes[2] = cross(axes[0], axes[1]);
+
+        vec3 halfExtent;
+        for (int a = 0; a < 3; ++a)
+            halfExtent += fabs(_size[a] / 2) * vec3(fabs(axes[a].x()), fabs(axes[a].y()), fabs(axes[a].z()));
+        bbox = aabb(center - halfExtent, center + halfExtent);
+    }
+
+    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        if (!box.hit(to_local(r), rayT, rec))
+            return false;
+
+        // Rotating and moving the local hit adds gamma(3) and gamma(1) rounding to its error
+        vec3 local = rec.p;
+        rec.p = center + to_world(local);
+        rec.pError = (1 + Util::gamma(3)) * to_world_abs(rec.pError) + Util::gamma(3) * to_world_abs(abs(local))
+            + Util::gamma(1) * abs(rec.p);
+        rec.normal = to_world(rec.normal);
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit_interval(const ray& r, interval rayT, interval& inside) const override {
+        return box.hit_interval(to_local(r), rayT, inside);
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        return box.pdf_value(to_local(origin - center), to_local(direction));
+    }
+
+    vec3 random(const point3& origin) const override {
+        return to_world(box.random(to_local(origin - center)));
+    }
+
+    double area() const override { return box.area(); }
+
+    shared_ptr<material> get_material() const override { return box.get_material(); }
+
+    double normal_cone(vec3& w) const override {
+        double cosThetaO = box.normal_cone(w);
+        w = to_world(w);
+        return cosThetaO;
+    }
+
+private:
+    point3 center;
+    vec3 axes[3];  // Local x, y, z in world space
+    Cube box;
+    aabb bbox;
+
+    vec3 to_local(const vec3& v) const {
+        return vec3(dot(v, axes[0]), dot(v, axes[1]), dot(v, axes[2]));
+    }
+
+    vec3 to_world(const vec3& v) const {
+        return v.x() * axes[0] + v.y() * axes[1] + v.z() * axes[2];
+    }
+
+    //  Bound of |to_world(v)| for any v within +-e
+    vec3 to_world_abs(const vec3& e) const {
+        return e.x() * abs(axes[0]) + e.y() * abs(axes[1]) + e.z() * abs(axes[2]);
+    }
+
+    ray to_local(const ray& r) const {
+        return ray(to_local(r.origin() - center), to_local(r.direction()), r.time());
+    }
+};
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,110 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include <cstdint>
+#include <utility>
+
+#include "../common.h"
+
+#include "hittable.h"
+
+//  Node of a BVH flattened into an array, depth first : an inner node (count == 0) has its first
+//  child right after it and its second one at `first`, with the first on the low side of `axis`.
+//  A leaf holds items [first, first + count) of the tree's own item list.
+struct FlatNode {
+    int32_t first;
+    int32_t count;
+    int32_t axis;
+};
+
+/*
+    Traversal shared by the flat BVHs (InstanceScene, MotionBvh, MappedBvh). They differ only in
+    where a node's box comes from : stored with it, interpolated between motion keys, or read from
+    a mapped file. So the walk is templated on
+        node(i)                 node i, or anything with FlatNode's first, count and axis
+        box(i)                  its bounds for this ray
+    and on what a leaf item is. A leaf with count < 0 holds nothing.
+*/
+namespace FlatBvh {
+
+    const int maxStack = 64;
+
+    //  Closest hit below `root`, hitItem(i, rayT, rec) tracing item i
+    template <typename NodeAt, typename BoxAt, typename HitItem>
+    bool hit(const NodeAt& node, const BoxAt& box, const HitItem& hitItem, const ray& r, interval rayT,
+        HitRecord& rec, int root = 0) {
+        int stack[maxStack];
+        int top = 0;
+        stack[top++] = root;
+        bool hitAnything = false;
+
+        while (top > 0) {
+            int index = stack[--top];
+            if (!box(index).hit(r, rayT))
+                continue;
+
+            const auto& n = node(index);
+            if (n.count != 0) {
+                for (int i = n.first; i < n.first + n.count; ++i)
+                    if (hitItem(i, rayT, rec)) {
+                        hitAnything = true;
+                        rayT.max = rec.t;
+                    }
+                continue;
+            }
+
+            //  Near child first, it can shorten rayT for the other. A tree deeper than the stack
+            //  goes on recursively.
+            int nearChild = index + 1, farChild = n.first;
+            if (r.direction()[n.axis] < 0)
+                std::swap(nearChild, farChild);
+            stack[top++] = farChild;
+            if (top < maxStack)
+                stack[top++] = nearChild;
+            else if (hit(node, box, hitItem, r, rayT, rec, nearChild)) {
+                hitAnything = true;
+                rayT.max = rec.t;
+            }
+        }
+
+        return hitAnything;
+    }
+
+    //  Product of the transmittances itemTransmittance(i) of the items below `root` along r
+    template <typename NodeAt, typename BoxAt, typename ItemTransmittance>
+    double transmittance(const NodeAt& node, const BoxAt& box, const ItemTransmittance& itemTransmittance,
+        const ray& r, interval rayT, int root = 0) {
+        int stack[maxStack];
+        int top = 0;
+        stack[top++] = root;
+        double result = 1.0;
+
+        while (top > 0) {
+            int index = stack[--top];
+            if (!box(index).hit(r, rayT))
+                continue;
+
+            const auto& n = node(index);
+            if (n.count != 0) {
+                for (int i = n.first; i < n.first + n.count; ++i) {
+                    result *= itemTransmittance(i);
+                    if (result <= 0.0)
+                        return 0.0;
+                }
+                continue;
+            }
+
+            stack[top++] = n.first;
+            if (top < maxStack)
+                stack[top++] = index + 1;
+            else
+                result *= transmittance(node, box, itemTransmittance, r, rayT, index + 1);
+            if (result <= 0.0)
+                return 0.0;
+        }
+
+        return result;
+    }
+}
+
+#endif
@@ -11,6 +11,8 @@
 // along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 //==============================================================================================
 
+#include <vector>
+
 #include "../common.h"
 #include "aabb.h"
 #include "math/transform.h"
@@ -25,6 +27,13 @@ public:
     double t;
     double u, v;
     bool frontFace;
+    vec3 pError;  // Bound on the rounding error of p per component, set after set_face_normal
+
+    //  Surface parameterization (dp/du, dp/dv), set after set_face_normal by primitives with uvs
+    vec3 dpdu, dpdv;
+    //  Change of the hit across one pixel, from the ray differentials
+    vec3 dpdx, dpdy;
+    double dudx = 0, dvdx = 0, dudy = 0, dvdy = 0;
  
     void set_face_normal(const ray& r, const vec3& outwardNormal) {
         // Sets the hit record normal vector.
@@ -32,6 +41,53 @@ public:
 
         frontFace = dot(r.direction(), outwardNormal) < 0;
         normal = frontFace ? outwardNormal : -outwardNormal;
+        dpdu = dpdv = vec3(0, 0, 0);
+        pError = vec3(0, 0, 0);
+    }
+
+    void compute_differentials(const RayDifferential& r) {
+        // Intersect the offset rays with the tangent plane at p, then express the offsets in
+        // (u, v) by least squares on dp/du, dp/dv.
+        dudx = dvdx = dudy = dvdy = 0;
+        dpdx = dpdy = vec3(0, 0, 0);
+        if (!r.has_differentials())
+            return;
+
+        double d = -dot(normal, p);
+        double denomX = dot(normal, r.rx_direction());
+        double denomY = dot(normal, r.ry_direction());
+        if (fabs(denomX) < Util::epsilon || fabs(denomY) < Util::epsilon)
+            return;
+
+        double tx = (-dot(normal, r.rx_origin()) - d) / denomX;
+        double ty = (-dot(normal, r.ry_origin()) - d) / denomY;
+        dpdx = r.rx_origin() + tx * r.rx_direction() - p;
+        dpdy = r.ry_origin() + ty * r.ry_direction() - p;
+
+        double ata00 = dot(dpdu, dpdu), ata01 = dot(dpdu, dpdv), ata11 = dot(dpdv, dpdv);
+        double det = ata00 * ata11 - ata01 * ata01;
+        if (fabs(det) < 1e-12)
+            return;
+        double invDet = 1 / det;
+
+        double atb0x = dot(dpdu, dpdx), atb1x = dot(dpdv, dpdx);
+        double atb0y = dot(dpdu, dpdy), atb1y = dot(dpdv, dpdy);
+
+        dudx = (ata11 * atb0x - ata01 * atb1x) * invDet;
+        dvdx = (ata00 * atb1x - ata01 * atb0x) * invDet;
+        dudy = (ata11 * atb0y - ata01 * atb1y) * invDet;
+        dvdy = (ata00 * atb1y - ata01 * atb0y) * invDet;
+    }
+
+    //  Ray leaving the hit toward `direction`, from an origin offset off the surface (see
+    //  offset_ray_origin), so it can be traced from t = 0 without hitting the surface again
+    ray spawn_ray(const vec3& direction, double time) const {
+        return ray(offset_ray_origin(p, pError, normal, direction), direction, time);
+    }
+
+    //  Width of the texture filter in (u, v), 0 when no differentials are known
+    double texture_footprint() const {
+        return 2 * fmax(fmax(fabs(dudx), fabs(dudy)), fmax(fabs(dvdx), fabs(dvdy)));
     }
 };
 
@@ -43,6 +99,91 @@ public:
     virtual bool hit(const ray& r, interval rayT, HitRecord& rec) const = 0;
 
     virtual aabb bounding_box() const = 0;
+
+    //  Motion : the primitive is at its key k at time k, for k = 0 ... motion_keys() - 1, moves
+    //  linearly from one key to the next and stays at its first and last keys before and after
+    //  them. key_bounding_box(k) bounds it at key k, bounding_box() over its whole path.
+    //  Static by default.
+    virtual int motion_keys() const { return 1; }
+
+    virtual aabb key_bounding_box(int key) const { return bounding_box(); }
+
+    //  Closest hits of `count` rays at once : rays[i] is tested over (tMin, tMax[i]), and on a hit
+    //  recs[i], isHit[i] and tMax[i] are updated. Acceleration structures override it to share
+    //  their traversal between the rays, the default traces them one by one.
+    virtual void hit_packet(const ray* rays, int count, double tMin, double* tMax, HitRecord* recs,
+        char* isHit) const {
+        HitRecord rec;
+        for (int i = 0; i < count; ++i)
+            if (hit(rays[i], interval(tMin, tMax[i]), rec)) {
+                recs[i] = rec;
+                isHit[i] = true;
+                tMax[i] = rec.t;
+            }
+    }
+
+    //  Parametric range where the ray is inside this (closed, convex) primitive, clipped to rayT.
+    //  The generic version finds the entry, then the first hit after it facing the other way :
+    //  hits facing like the entry just past it are the entry found again through rounding. No
+    //  exit before rayT.max means the ray is still inside there. Primitives with a closed form
+    //  override it.
+    virtual bool hit_interval(const ray& r, interval rayT, interval& inside) const {
+        HitRecord entry, exit;
+
+        if (!hit(r, interval(-Util::infinity, rayT.max), entry))
+            return false;
+
+        double exitT = rayT.max;
+        double from = entry.t;
+        while (hit(r, interval(std::nextafter(from, Util::infinity), rayT.max), exit)) {
+            if (exit.frontFace != entry.frontFace) {
+                exitT = exit.t;
+                break;
+            }
+            from = exit.t;
+        }
+
+        inside = interval(fmax(entry.t, rayT.min), exitT);
+        return inside.min < inside.max;
+    }
+
+    //  Light sampling interface, only meaningful for primitives that can be used as emitters.
+    //  pdf_value is the solid angle density of `random` for a direction leaving `origin`.
+    virtual double pdf_value(const point3& origin, const vec3& direction) const {
+        return 0.0;
+    }
+
+    virtual vec3 random(const point3& origin) const {
+        return vec3(1, 0, 0);
+    }
+
+    virtual double area() const {
+        return 0.0;
+    }
+
+    virtual shared_ptr<material> get_material() const {
+        return nullptr;
+    }
+
+    //  Cone bounding the surface normals up to their sign, for the light hierarchy : its axis is
+    //  stored in w and the cosine of its half angle returned, -1 when they point every way.
+    virtual double normal_cone(vec3& w) const {
+        w = vec3(0, 0, 1);
+        return -1;
+    }
+
+    //  Scene traversal, for the light hierarchy gathering emitters : a container adds the parts
+    //  it holds as they are, in world space, to `parts`, and those it moves into another space
+    //  (trs, instances) to `transformed`. Primitives hold none.
+    virtual void children(std::vector<shared_ptr<Hittable>>& /*parts*/,
+        std::vector<shared_ptr<Hittable>>& /*transformed*/) const {}
+
+    //  Fraction of light passing along the ray segment, used for shadow rays.
+    //  Opaque by default : anything hit inside the segment blocks it completely.
+    virtual double transmittance(const ray& r, interval rayT) const {
+        HitRecord rec;
+        return hit(r, rayT, rec) ? 0.0 : 1.0;
+    }
 };
 
 
@@ -47,8 +47,30 @@ public:
         return hitAnything;
     }
 
+    void hit_packet(const ray* rays, int count, double tMin, double* tMax, HitRecord* recs,
+        char* isHit) const override {
+        // tMax shrinks as closer hits are found, exactly as currentClosest does in hit.
+        for (const auto& object : objects)
+            object->hit_packet(rays, count, tMin, tMax, recs, isHit);
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        double result = 1.0;
+        for (const auto& object : objects) {
+            result *= object->transmittance(r, rayT);
+            if (result <= 0.0)
+                return 0.0;
+        }
+        return result;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    void children(std::vector<shared_ptr<Hittable>>& parts,
+        std::vector<shared_ptr<Hittable>>& /*transformed*/) const override {
+        parts.insert(parts.end(), objects.begin(), objects.end());
+    }
+
 private:
     aabb bbox;
 };
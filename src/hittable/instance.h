@@ -0,0 +1,175 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "../common.h"
+
+#include "Hittable.h"
+#include "flatBvh.h"
+#include "translate.h"
+
+/*
+    Two level acceleration structure for instanced geometry. Each distinct object (a mesh, a
+    bvhNode over many primitives, ...) is a bottom level structure added once with add_object ;
+    an instance is only a transform and the id of the object it places. The top level BVH is built
+    over the instances' world bounds, and a ray reaching an instance's leaf is moved into its local
+    space and traced through the shared bottom level. Each copy costs one Instance and its share
+    of the top level nodes, whatever the size of the geometry it places.
+*/
+class InstanceScene : public Hittable {
+public:
+    //  Bottom level structure, placed by add_instance with the returned id
+    int add_object(shared_ptr<Hittable> object) {
+        objects.push_back(object);
+        return static_cast<int>(objects.size()) - 1;
+    }
+
+    void add_instance(int objectId, const TransformMatrix& m) {
+        if (objectId < 0 || objectId >= static_cast<int>(objects.size()))
+            throw std::runtime_error("Unknown instanced object");
+
+        Instance instance;
+        instance.transform = AffineTransform(m);
+        instance.object = objectId;
+        instance.bbox = instance.transform.bounds(objects[objectId]->bounding_box());
+        instances.push_back(instance);
+        nodes.clear();
+    }
+
+    //  Builds the top level BVH, must be called after the last add_instance and before tracing
+    void build() {
+        nodes.clear();
+        if (instances.empty())
+            return;
+        instances.shrink_to_fit();
+        nodes.reserve(2 * instances.size());
+        build_node(0, static_cast<int>(instances.size()));
+        bbox = nodes[0].bbox;
+    }
+
+    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        return FlatBvh::hit([this](int i) -> const Node& { return nodes[i]; },
+            [this](int i) -> const aabb& { return nodes[i].bbox; },
+            [this, &r](int i, interval t, HitRecord& itemRec) { return hit_instance(instances[i], r, t, itemRec); },
+            r, rayT, rec);
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        if (nodes.empty())
+            return 1.0;
+
+        return FlatBvh::transmittance([this](int i) -> const Node& { return nodes[i]; },
+            [this](int i) -> const aabb& { return nodes[i].bbox; },
+            [this, &r, rayT](int i) {
+                const Instance& instance = instances[i];
+                const Hittable& object = *objects[instance.object];
+                return instance.transform.is_identity() ? object.transmittance(r, rayT)
+                    : object.transmittance(instance.transform.inverse(r), rayT);
+            },
+            r, rayT);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void children(std::vector<shared_ptr<Hittable>>& /*parts*/,
+        std::vector<shared_ptr<Hittable>>& transformed) const override {
+        transformed.insert(transformed.end(), objects.begin(), objects.end());
+    }
+
+    size_t instance_count() const { return instances.size(); }
+
+    size_t object_count() const { return objects.size(); }
+
+    //  Bytes held by the instances and the top level, the shared objects excluded
+    size_t top_level_bytes() const {
+        return instances.capacity() * sizeof(Instance) + nodes.capacity() * sizeof(Node);
+    }
+
+private:
+    struct Instance {
+        AffineTransform transform;
+        aabb bbox;
+        int object;
+    };
+
+    //  FlatNode links, leaves holding instances[first, first + count)
+    struct Node {
+        aabb bbox;
+        int first;
+        int count;
+        int axis;
+    };
+
+    static const int maxLeafSize = 2;
+
+    std::vector<shared_ptr<Hittable>> objects;
+    std::vector<Instance> instances;
+    std::vector<Node> nodes;
+    aabb bbox;
+
+    bool hit_instance(const Instance& instance, const ray& r, interval rayT, HitRecord& rec) const {
+        if (!instance.bbox.hit(r, rayT))
+            return false;
+
+        const Hittable& object = *objects[instance.object];
+        if (instance.transform.is_identity())
+            return object.hit(r, rayT, rec);
+
+        if (!object.hit(instance.transform.inverse(r), rayT, rec))
+            return false;
+        trs::to_world(instance.transform, rec);
+        return true;
+    }
+
+    //  Twice the bounds' center along `axis`, all the build needs to order instances
+    static double centroid(const Instance& instance, int axis) {
+        const interval& span = instance.bbox.axis(axis);
+        return span.min + span.max;
+    }
+
+    //  Median split of instances[start, end) along the longest axis of their centroids' bounds.
+    //  Halving keeps the depth at log2 of the instance count, well within FlatBvh::maxStack.
+    int build_node(int start, int end) {
+        int index = static_cast<int>(nodes.size());
+        nodes.push_back(Node());
+
+        aabb bounds, centroids;
+        for (int i = start; i < end; ++i) {
+            bounds = aabb(bounds, instances[i].bbox);
+            point3 c(centroid(instances[i], 0), centroid(instances[i], 1), centroid(instances[i], 2));
+            centroids = aabb(centroids, aabb(c, c));
+        }
+        nodes[index].bbox = bounds;
+
+        if (end - start <= maxLeafSize) {
+            nodes[index].first = start;
+            nodes[index].count = end - start;
+            nodes[index].axis = 0;
+            return index;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; ++a)
+            if (centroids.axis(a).size() > centroids.axis(axis).size())
+                axis = a;
+
+        int mid = start + (end - start) / 2;
+        std::nth_element(instances.begin() + start, instances.begin() + mid, instances.begin() + end,
+            [axis](const Instance& a, const Instance& b) { return centroid(a, axis) < centroid(b, axis); });
+
+        build_node(start, mid);
+        int second = build_node(mid, end);
+        nodes[index].first = second;
+        nodes[index].count = 0;
+        nodes[index].axis = axis;
+        return index;
+    }
+};
+
+#endif
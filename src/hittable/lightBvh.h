@@ -0,0 +1,305 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "../common.h"
+#include "../material.h"
+
+#include "hittable.h"
+#include "hittableList.h"
+
+/*
+    Bounds of a set of emitters : where they are (bbox), how much they emit (phi) and in which
+    directions. Emission is bounded by a cone of normals (axis w, half angle thetaO) around which
+    light leaves within thetaE, following the light BVH of PBRT v4.
+*/
+struct LightBounds {
+    aabb bounds;
+    double phi = 0;
+    vec3 w = vec3(0, 0, 1);
+    double cosThetaO = -1;  // Normal cone, -1 : normals in all directions
+    double cosThetaE = 0;   // Emission falloff around normals, 0 : whole hemisphere
+    bool twoSided = true;
+
+    LightBounds() {}
+
+    LightBounds(const aabb& _bounds, double _phi, const vec3& _w, double _cosThetaO, double _cosThetaE,
+        bool _twoSided)
+        : bounds(_bounds), phi(_phi), w(_w), cosThetaO(_cosThetaO), cosThetaE(_cosThetaE), twoSided(_twoSided) {}
+
+    LightBounds(const LightBounds& a, const LightBounds& b) {
+        if (a.phi == 0) { *this = b; return; }
+        if (b.phi == 0) { *this = a; return; }
+
+        bounds = aabb(a.bounds, b.bounds);
+        phi = a.phi + b.phi;
+        union_cone(a.w, a.cosThetaO, b.w, b.cosThetaO, w, cosThetaO);
+        cosThetaE = fmin(a.cosThetaE, b.cosThetaE);
+        twoSided = a.twoSided || b.twoSided;
+    }
+
+    point3 centroid() const {
+        return point3(bounds.x.min + bounds.x.max, bounds.y.min + bounds.y.max, bounds.z.min + bounds.z.max) / 2;
+    }
+
+    double importance(const point3& p) const {
+        // Conservative estimate of the power arriving at p from these lights.
+        point3 pc = centroid();
+        vec3 diagonal = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size());
+        double d2 = fmax((p - pc).length_squared(), diagonal.length_squared() / 4);
+
+        vec3 wi = p - pc;
+        double cosThetaW = wi.near_zero() ? 1 : dot(w, unit_vector(wi));
+        if (twoSided)
+            cosThetaW = fabs(cosThetaW);
+        double sinThetaW = safe_sqrt(1 - cosThetaW * cosThetaW);
+
+        //  Angle subtended by the bounds' bounding sphere as seen from p
+        double radiusSquared = diagonal.length_squared() / 4;
+        double cosThetaB = (p - pc).length_squared() <= radiusSquared ? -1
+            : safe_sqrt(1 - radiusSquared / (p - pc).length_squared());
+        double sinThetaB = safe_sqrt(1 - cosThetaB * cosThetaB);
+
+        //  cos(max(0, thetaW - thetaO - thetaB))
+        double sinThetaO = safe_sqrt(1 - cosThetaO * cosThetaO);
+        double cosThetaX = cos_sub_clamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+        double sinThetaX = sin_sub_clamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+        double cosThetaP = cos_sub_clamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+
+        if (cosThetaP <= cosThetaE)
+            return 0;
+
+        return phi * cosThetaP / d2;
+    }
+
+private:
+    static double safe_sqrt(double x) { return sqrt(fmax(0.0, x)); }
+
+    static double cos_sub_clamped(double sinA, double cosA, double sinB, double cosB) {
+        if (cosA > cosB) return 1;
+        return cosA * cosB + sinA * sinB;
+    }
+
+    static double sin_sub_clamped(double sinA, double cosA, double sinB, double cosB) {
+        if (cosA > cosB) return 0;
+        return sinA * cosB - cosA * sinB;
+    }
+
+    static void union_cone(const vec3& wa, double cosA, const vec3& wb, double cosB, vec3& wOut, double& cosOut) {
+        double thetaA = acos(Util::clamp(cosA, -1.0, 1.0));
+        double thetaB = acos(Util::clamp(cosB, -1.0, 1.0));
+        double thetaD = acos(Util::clamp(dot(wa, wb), -1.0, 1.0));
+
+        //  One cone already contains the other
+        if (fmin(thetaD + thetaB, Util::pi) <= thetaA) { wOut = wa; cosOut = cosA; return; }
+        if (fmin(thetaD + thetaA, Util::pi) <= thetaB) { wOut = wb; cosOut = cosB; return; }
+
+        double thetaO = (thetaA + thetaD + thetaB) / 2;
+        if (thetaO >= Util::pi) { wOut = wa; cosOut = -1; return; }
+
+        //  Rotate wa toward wb to the center of the merged cone
+        double thetaR = thetaO - thetaA;
+        vec3 axis = cross(wa, wb);
+        if (axis.near_zero()) { wOut = wa; cosOut = -1; return; }
+        axis = unit_vector(axis);
+        wOut = wa * cos(thetaR) + cross(axis, wa) * sin(thetaR) + axis * dot(axis, wa) * (1 - cos(thetaR));
+        cosOut = cos(thetaO);
+    }
+};
+
+class LightBvhNode {
+public:
+    LightBvhNode(std::vector<shared_ptr<Hittable>>& lights, std::vector<LightBounds>& lightBounds,
+        size_t start, size_t end) {
+
+        size_t objectSpan = end - start;
+
+        if (objectSpan == 1) {
+            light = lights[start];
+            bounds = lightBounds[start];
+            return;
+        }
+
+        //  Split at the median centroid along the widest axis of the centroid bounds
+        aabb centroidBounds;
+        for (size_t i = start; i < end; ++i) {
+            point3 c = lightBounds[i].centroid();
+            centroidBounds = aabb(centroidBounds, aabb(c, c));
+        }
+        int axis = 0;
+        if (centroidBounds.y.size() > centroidBounds.axis(axis).size()) axis = 1;
+        if (centroidBounds.z.size() > centroidBounds.axis(axis).size()) axis = 2;
+
+        std::vector<size_t> order(objectSpan);
+        for (size_t i = 0; i < objectSpan; ++i)
+            order[i] = start + i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return lightBounds[a].centroid()[axis] < lightBounds[b].centroid()[axis];
+        });
+
+        std::vector<shared_ptr<Hittable>> sortedLights(objectSpan);
+        std::vector<LightBounds> sortedBounds(objectSpan);
+        for (size_t i = 0; i < objectSpan; ++i) {
+            sortedLights[i] = lights[order[i]];
+            sortedBounds[i] = lightBounds[order[i]];
+        }
+        std::copy(sortedLights.begin(), sortedLights.end(), lights.begin() + start);
+        std::copy(sortedBounds.begin(), sortedBounds.end(), lightBounds.begin() + start);
+
+        auto mid = start + objectSpan / 2;
+        left = make_shared<LightBvhNode>(lights, lightBounds, start, mid);
+        right = make_shared<LightBvhNode>(lights, lightBounds, mid, end);
+
+        bounds = LightBounds(left->bounds, right->bounds);
+    }
+
+    const Hittable* sample(const point3& origin, double& pmf) const {
+        if (light != nullptr)
+            return light.get();
+
+        double pLeft;
+        if (!child_probability(origin, pLeft))
+            return nullptr;
+
+        if (Util::random_double() < pLeft) {
+            pmf *= pLeft;
+            return left->sample(origin, pmf);
+        }
+        pmf *= 1 - pLeft;
+        return right->sample(origin, pmf);
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction, double pmf) const {
+        if (light != nullptr)
+            return pmf * light->pdf_value(origin, direction);
+
+        //  Only subtrees the direction passes through can have generated it
+        if (!bounds.bounds.hit(ray(origin, direction, 0.0), interval(0, Util::infinity)))
+            return 0;
+
+        double pLeft;
+        if (!child_probability(origin, pLeft))
+            return 0;
+
+        double pdf = 0;
+        if (pLeft > 0)
+            pdf += left->pdf_value(origin, direction, pmf * pLeft);
+        if (pLeft < 1)
+            pdf += right->pdf_value(origin, direction, pmf * (1 - pLeft));
+        return pdf;
+    }
+
+    const LightBounds& light_bounds() const { return bounds; }
+
+private:
+    shared_ptr<LightBvhNode> left;
+    shared_ptr<LightBvhNode> right;
+    shared_ptr<Hittable> light;
+    LightBounds bounds;
+
+    bool child_probability(const point3& origin, double& pLeft) const {
+        double importanceLeft = left->bounds.importance(origin);
+        double importanceRight = right->bounds.importance(origin);
+
+        if (importanceLeft + importanceRight <= 0)
+            return false;
+
+        pLeft = importanceLeft / (importanceLeft + importanceRight);
+        return true;
+    }
+};
+
+/*
+    Light hierarchy over every DiffuseLight primitive of the world, so that a shading point picks
+    an emitter with probability proportional to its estimated contribution in O(log n). Emitters
+    are gathered through the containers holding them in world space (lists, BVHs) ; one placed by
+    a transform (trs, InstanceScene) could not be sampled where it is, and is an error.
+*/
+class LightBvh {
+public:
+    LightBvh() {}
+
+    LightBvh(const HittableList& world) {
+        std::vector<shared_ptr<Hittable>> lights;
+        std::vector<LightBounds> lightBounds;
+        gather(world.objects, lights, lightBounds);
+
+        if (!lights.empty())
+            root = make_shared<LightBvhNode>(lights, lightBounds, 0, lights.size());
+        numLights = lights.size();
+    }
+
+    bool empty() const { return root == nullptr; }
+
+    size_t size() const { return numLights; }
+
+    //  Choose a light for `origin` and a direction toward it. Returns nullptr if no light matters.
+    const Hittable* sample(const point3& origin, vec3& direction) const {
+        if (root == nullptr)
+            return nullptr;
+
+        double pmf = 1;
+        const Hittable* light = root->sample(origin, pmf);
+        if (light != nullptr)
+            direction = light->random(origin);
+        return light;
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const {
+        if (root == nullptr)
+            return 0;
+        return root->pdf_value(origin, direction, 1);
+    }
+
+private:
+    shared_ptr<LightBvhNode> root;
+    size_t numLights = 0;
+
+    static bool is_emitter(const Hittable& object) {
+        auto mat = object.get_material();
+        //  Primitives without an area can not be sampled
+        return mat != nullptr && std::dynamic_pointer_cast<DiffuseLight>(mat) != nullptr && object.area() > 0;
+    }
+
+    static bool holds_emitter(const std::vector<shared_ptr<Hittable>>& objects) {
+        for (const auto& object : objects) {
+            std::vector<shared_ptr<Hittable>> parts;
+            object->children(parts, parts);
+            if (is_emitter(*object) || holds_emitter(parts))
+                return true;
+        }
+        return false;
+    }
+
+    static void gather(const std::vector<shared_ptr<Hittable>>& objects, std::vector<shared_ptr<Hittable>>& lights,
+        std::vector<LightBounds>& lightBounds) {
+        for (const auto& object : objects) {
+            std::vector<shared_ptr<Hittable>> parts, transformed;
+            object->children(parts, transformed);
+            gather(parts, lights, lightBounds);
+            if (holds_emitter(transformed))
+                throw std::runtime_error("LightBvh : emitters placed by a transform (trs, InstanceScene) can not be sampled");
+
+            if (!is_emitter(*object))
+                continue;
+
+            aabb bbox = object->bounding_box();
+            point3 center = point3(bbox.x.min + bbox.x.max, bbox.y.min + bbox.y.max, bbox.z.min + bbox.z.max) / 2;
+            double phi = Util::pi * object->area() * luminance(object->get_material()->emitted(0.5, 0.5, center));
+            if (phi <= 0)
+                continue;
+
+            //  DiffuseLight emits from both faces, so lights are two sided and their cones only
+            //  bound the normals up to their sign
+            vec3 w;
+            double cosThetaO = object->normal_cone(w);
+            lights.push_back(object);
+            lightBounds.push_back(LightBounds(bbox, phi, w, cosThetaO, 0, true));
+        }
+    }
+};
+
+#endif
@@ -6,6 +6,8 @@
 #include "Hittable.h"
 #include "../material.h"
 #include "../texture.h"
+#include "../tool/density.h"
+#include "../tool/majorantGrid.h"
 
 class ConstantMedium : public Hittable {
 public:
@@ -22,28 +24,14 @@ public:
         const bool enableDebug = false;
         const bool debugging = enableDebug && Util::random_double() < 0.000001;
 
-        HitRecord rec1, rec2;
-
-        if (!boundary->hit(r, interval(-Util::infinity, Util::infinity), rec1))
-            return false;
-
-        if (!boundary->hit(r, interval(rec1.t + 0.0001, Util::infinity), rec2))
+        interval inside;
+        if (!boundary->hit_interval(r, ray_t, inside))
             return false;
 
-        if (debugging) std::clog << "\nray_tmin=" << rec1.t << ", ray_tmax=" << rec2.t << '\n';
-
-        //  Clamp in ray interval
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
-
-        if (rec1.t >= rec2.t)
-            return false;
-
-        if (rec1.t < 0)
-            rec1.t = 0;
+        if (debugging) std::clog << "\nray_tmin=" << inside.min << ", ray_tmax=" << inside.max << '\n';
 
         auto rayLength = r.direction().length();
-        auto distanceInsideBoundary = (rec2.t - rec1.t) * rayLength;
+        auto distanceInsideBoundary = inside.size() * rayLength;
         //  Random'y determine the scatter point along the ray
         //  C * delta L
         auto hitDistance = negInvDensity * log(Util::random_double());
@@ -51,7 +39,7 @@ public:
         if (hitDistance > distanceInsideBoundary)
             return false;
 
-        rec.t = rec1.t + hitDistance / rayLength;
+        rec.t = inside.min + hitDistance / rayLength;
         rec.p = r.at(rec.t);
 
         if (debugging) {
@@ -62,11 +50,22 @@ public:
 
         rec.normal = vec3(1, 0, 0);  // arbitrary
         rec.frontFace = true;     // also arbitrary
+        rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+        rec.pError = vec3(0, 0, 0);  // No surface to leave
         rec.mat = phaseFunction;
 
         return true;
     }
 
+    double transmittance(const ray& r, interval rayT) const override {
+        // Beer-Lambert, exp(-density * distance).
+        interval inside;
+        if (!boundary->hit_interval(r, rayT, inside))
+            return 1.0;
+
+        return exp(inside.size() * r.direction().length() / negInvDensity);
+    }
+
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
 private:
@@ -75,4 +74,101 @@ private:
     shared_ptr<material> phaseFunction;
 };
 
-#endif
\ No newline at end of file
+/*
+    Medium whose density varies in space. Free flights are sampled against a majorant and accepted
+    with probability density / majorant : delta tracking for scattering, ratio tracking for
+    transmittance. Majorants come from a coarse grid of per-voxel maximum densities walked with a
+    DDA, so empty and thin regions are crossed in few steps; a resolution of 1 gives back a single
+    global majorant.
+*/
+class HeterogeneousMedium : public Hittable {
+public:
+    HeterogeneousMedium(shared_ptr<Hittable> b, shared_ptr<DensityField> d, shared_ptr<texture> a,
+        int majorantResolution = 16)
+        : boundary(b), densityField(d), phaseFunction(make_shared<Isotropic>(a)),
+        majorants(*d, b->bounding_box(), majorantResolution)
+    {}
+
+    HeterogeneousMedium(shared_ptr<Hittable> b, shared_ptr<DensityField> d, color c,
+        int majorantResolution = 16)
+        : boundary(b), densityField(d), phaseFunction(make_shared<Isotropic>(c)),
+        majorants(*d, b->bounding_box(), majorantResolution)
+    {}
+
+    bool hit(const ray& r, interval ray_t, HitRecord& rec) const override {
+        interval inside;
+        if (!boundary->hit_interval(r, ray_t, inside))
+            return false;
+
+        auto rayLength = r.direction().length();
+        MajorantIterator segments(majorants, r, inside);
+        double tMin, tMax, majorant;
+        while (segments.next(tMin, tMax, majorant)) {
+            if (majorant <= 0)
+                continue;
+
+            auto t = tMin;
+            while (true) {
+                t -= log(1 - Util::random_double()) / (majorant * rayLength);
+                if (t >= tMax)
+                    break;
+
+                //  Real collision with probability density / majorant, otherwise a null collision
+                point3 p = r.at(t);
+                if (Util::random_double() * majorant < densityField->density(p)) {
+                    rec.t = t;
+                    rec.p = p;
+                    rec.normal = vec3(1, 0, 0);  // arbitrary
+                    rec.frontFace = true;     // also arbitrary
+                    rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+                    rec.pError = vec3(0, 0, 0);
+                    rec.mat = phaseFunction;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        interval inside;
+        if (!boundary->hit_interval(r, rayT, inside))
+            return 1.0;
+
+        auto rayLength = r.direction().length();
+        MajorantIterator segments(majorants, r, inside);
+        double tMin, tMax, majorant;
+        double result = 1.0;
+        while (segments.next(tMin, tMax, majorant)) {
+            if (majorant <= 0)
+                continue;
+
+            auto t = tMin;
+            while (true) {
+                t -= log(1 - Util::random_double()) / (majorant * rayLength);
+                if (t >= tMax)
+                    break;
+
+                result *= 1 - fmin(densityField->density(r.at(t)) / majorant, 1.0);
+
+                //  Russian roulette once the estimate gets small
+                if (result < 0.1) {
+                    if (Util::random_double() < 0.5)
+                        return 0.0;
+                    result *= 2;
+                }
+            }
+        }
+        return result;
+    }
+
+    aabb bounding_box() const override { return boundary->bounding_box(); }
+
+private:
+    shared_ptr<Hittable> boundary;
+    shared_ptr<DensityField> densityField;
+    shared_ptr<material> phaseFunction;
+    MajorantGrid majorants;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include <algorithm>
+#include <vector>
+
+#include "../common.h"
+
+#include "Hittable.h"
+#include "HittableList.h"
+#include "flatBvh.h"
+
+/*
+    BVH for scenes with moving primitives. A bvhNode bounds a moving primitive over its whole path,
+    so with a long shutter its boxes grow along the motion and overlap. Here every node stores its
+    bounds at each motion key (see Hittable::motion_keys), and traversal interpolates them at the
+    ray's time : since primitives move linearly between keys, the interpolated box of a node still
+    contains its children at that time, and is about as tight as a static scene's.
+*/
+class MotionBvh : public Hittable {
+public:
+    MotionBvh(const HittableList& list) : primitives(list.objects), keys(1) {
+        for (const auto& object : primitives)
+            keys = std::max(keys, object->motion_keys());
+
+        if (primitives.empty())
+            return;
+
+        nodes.reserve(2 * primitives.size());
+        boxes.reserve(2 * primitives.size() * keys);
+        build_node(0, static_cast<int>(primitives.size()));
+
+        for (const auto& object : primitives)
+            bbox = aabb(bbox, object->bounding_box());
+    }
+
+    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        KeyTime key = key_time(r.time());
+        return FlatBvh::hit([this](int i) -> const FlatNode& { return nodes[i]; },
+            [this, &key](int i) { return node_box(i, key); },
+            [this, &r](int i, interval t, HitRecord& itemRec) { return primitives[i]->hit(r, t, itemRec); },
+            r, rayT, rec);
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        if (nodes.empty())
+            return 1.0;
+
+        KeyTime key = key_time(r.time());
+        return FlatBvh::transmittance([this](int i) -> const FlatNode& { return nodes[i]; },
+            [this, &key](int i) { return node_box(i, key); },
+            [this, &r, rayT](int i) { return primitives[i]->transmittance(r, rayT); },
+            r, rayT);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    int motion_keys() const override { return keys; }
+
+    aabb key_bounding_box(int key) const override {
+        return nodes.empty() ? aabb() : boxes[key];
+    }
+
+    void children(std::vector<shared_ptr<Hittable>>& parts,
+        std::vector<shared_ptr<Hittable>>& /*transformed*/) const override {
+        parts.insert(parts.end(), primitives.begin(), primitives.end());
+    }
+
+private:
+    //  Time as the pair of keys around it and the weight of the second one
+    struct KeyTime {
+        int key;
+        double fraction;
+    };
+
+    static const int maxLeafSize = 2;
+    static const int maxMiddleDepth = 24;  // Leaves FlatBvh::maxStack - 24 levels of median splits, 2^40 primitives
+
+    //  Leaves hold primitives[first, first + count), node i's bounds at key k are boxes[i * keys + k]
+    std::vector<shared_ptr<Hittable>> primitives;
+    std::vector<FlatNode> nodes;
+    std::vector<aabb> boxes;
+    int keys;
+    aabb bbox;
+
+    KeyTime key_time(double time) const {
+        if (keys == 1 || time <= 0)
+            return KeyTime{ 0, 0 };
+        if (time >= keys - 1)
+            return KeyTime{ keys - 2, 1 };
+        int key = static_cast<int>(time);
+        return KeyTime{ key, time - key };
+    }
+
+    aabb node_box(int index, const KeyTime& time) const {
+        const aabb* key = &boxes[index * keys + time.key];
+        if (time.fraction == 0)
+            return key[0];
+
+        auto lerp = [&time](const interval& a, const interval& b) {
+            return interval(a.min + time.fraction * (b.min - a.min), a.max + time.fraction * (b.max - a.max));
+        };
+        return aabb(lerp(key[0].x, key[1].x), lerp(key[0].y, key[1].y), lerp(key[0].z, key[1].z));
+    }
+
+    //  Bounds of a primitive at key k, primitives with fewer keys staying at their last one
+    static aabb primitive_box(const Hittable& object, int key) {
+        int objectKeys = object.motion_keys();
+        return objectKeys == 1 ? object.bounding_box() : object.key_bounding_box(std::min(key, objectKeys - 1));
+    }
+
+    //  Twice the center of the primitive's bounds averaged over the keys, along `axis`
+    double centroid(const Hittable& object, int axis) const {
+        double sum = 0;
+        for (int k = 0; k < keys; ++k) {
+            interval span = primitive_box(object, k).axis(axis);
+            sum += span.min + span.max;
+        }
+        return sum / keys;
+    }
+
+    //  Split of primitives[start, end) along the longest axis of their centroids' bounds, at its
+    //  middle : that isolates far away outliers such as a ground sphere, which would skew a median
+    //  split. The median is used instead when the middle leaves a side empty, and past
+    //  maxMiddleDepth so that the depth, and the traversal stack, stays bounded.
+    int build_node(int start, int end, int depth = 0) {
+        int index = static_cast<int>(nodes.size());
+        nodes.push_back(FlatNode());
+        boxes.resize(boxes.size() + keys);
+
+        aabb centroids;
+        for (int i = start; i < end; ++i) {
+            for (int k = 0; k < keys; ++k)
+                boxes[index * keys + k] = aabb(boxes[index * keys + k], primitive_box(*primitives[i], k));
+            point3 c(centroid(*primitives[i], 0), centroid(*primitives[i], 1), centroid(*primitives[i], 2));
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        if (end - start <= maxLeafSize) {
+            nodes[index] = FlatNode{ start, end - start, 0 };
+            return index;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; ++a)
+            if (centroids.axis(a).size() > centroids.axis(axis).size())
+                axis = a;
+
+        int mid = start;
+        if (depth < maxMiddleDepth) {
+            double middle = centroids.axis(axis).min + centroids.axis(axis).size() / 2;
+            mid = static_cast<int>(std::partition(primitives.begin() + start, primitives.begin() + end,
+                [this, axis, middle](const shared_ptr<Hittable>& a) { return centroid(*a, axis) < middle; })
+                - primitives.begin());
+        }
+        if (mid == start || mid == end) {
+            mid = start + (end - start) / 2;
+            std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end,
+                [this, axis](const shared_ptr<Hittable>& a, const shared_ptr<Hittable>& b) {
+                    return centroid(*a, axis) < centroid(*b, axis);
+                });
+        }
+
+        build_node(start, mid, depth + 1);
+        int second = build_node(mid, end, depth + 1);
+        nodes[index] = FlatNode{ second, 0, axis };
+        return index;
+    }
+};
+
+#endif
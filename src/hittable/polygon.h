@@ -47,9 +47,10 @@ public:
             return false;
 
         rec.t = tMax;
-        rec.p = r.at(tMax);
         vec3 outwardNormal = faces[hitFacesIdx]->normal;
         rec.set_face_normal(r, outwardNormal);
+        const point3* v = faces[hitFacesIdx]->vertices;
+        rec.p = triangle_point(v[0], v[1], v[2], r.at(tMax), rec.pError);
         rec.mat = mat;
 
         return true;
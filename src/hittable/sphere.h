@@ -11,7 +11,10 @@
 // along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 //==============================================================================================
 
+#include <utility>
+
 #include "hittable.h"
+#include "../math/onb.h"
 
 class Sphere : public Hittable {
 public:
@@ -37,42 +40,109 @@ public:
 
     bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
 
-        // Convert to local space
-        ray rLocal = worldToLocal(r);
-
-        point3 center = isMoving ? this->center(rLocal.time()) : centers[0];
-        vec3 oc = rLocal.origin() - center;
-        auto a = rLocal.direction().length_squared();
-        auto half_b = dot(oc, rLocal.direction());
+        point3 center = isMoving ? this->center(r.time()) : centers[0];
+        vec3 oc = r.origin() - center;
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
         auto c = oc.length_squared() - radius * radius;
 
-        auto discriminant = half_b * half_b - a * c;
+        // Discriminant from the distance of the center to the ray's line, which does not cancel
+        // out like half_b^2 - a c for rays far away from the sphere
+        vec3 f = oc - (half_b / a) * r.direction();
+        auto discriminant = a * (radius * radius - f.length_squared());
         if (discriminant < 0)
             return false;
 
-        // Find the nearest root that lies in the acceptable range.
+        // Roots computed without subtracting close values : the one near 0 of a ray leaving the
+        // surface comes out of c / q, with the sign of c
         auto sqrtd = sqrt(discriminant);
-        auto root = (-half_b - sqrtd) / a;
-        // convert root to world space
+        auto q = -(half_b + std::copysign(sqrtd, half_b));
+        auto t0 = q / a, t1 = c / q;
+        if (t0 > t1)
+            std::swap(t0, t1);
 
+        // Find the nearest root that lies in the acceptable range.
+        auto root = t0;
         if (!rayT.surrounds(root)) {
-            root = (-half_b + sqrtd) / a;
+            root = t1;
             if (!rayT.surrounds(root))
                 return false;
         }
 
+        // The hit moved back onto the sphere, within gamma(5) of it
+        vec3 local = r.at(root) - center;
+        local *= radius / local.length();
+
         rec.t = root;
-        rec.p = rLocal.at(rec.t);
-        vec3 outward_normal = (rec.p - center) / radius;
-        rec.set_face_normal(rLocal, outward_normal);
+        rec.p = center + local;
+        vec3 outward_normal = local / radius;
+        rec.set_face_normal(r, outward_normal);
+        rec.pError = Util::gamma(5) * abs(local) + Util::gamma(1) * abs(rec.p);
         rec.mat = mat;
         get_sphere_uv(outward_normal, rec.u, rec.v);
+        get_sphere_partials(rec.u, rec.v, rec.dpdu, rec.dpdv);
 
         return true;
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    int motion_keys() const override { return static_cast<int>(centers.size()); }
+
+    aabb key_bounding_box(int key) const override {
+        auto rVec = vec3(radius, radius, radius);
+        return aabb(centers[key] - rVec, centers[key] + rVec);
+    }
+
+    bool hit_interval(const ray& r, interval rayT, interval& inside) const override {
+        // Both roots of the same quadratic as hit.
+        point3 center = isMoving ? this->center(r.time()) : centers[0];
+        vec3 oc = r.origin() - center;
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius * radius;
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = sqrt(discriminant);
+        inside = interval(fmax((-half_b - sqrtd) / a, rayT.min), fmin((-half_b + sqrtd) / a, rayT.max));
+        return inside.min < inside.max;
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        // This method only works for stationary spheres.
+
+        HitRecord rec;
+        if (!this->hit(ray(origin, direction, 0.0), interval(0, Util::infinity), rec))
+            return 0;
+
+        auto distanceSquared = (centers[0] - origin).length_squared();
+        //  Origin inside the sphere : directions are sampled uniformly over the whole sphere
+        if (distanceSquared <= radius * radius)
+            return 1 / (4 * Util::pi);
+
+        auto cosThetaMax = sqrt(1 - radius * radius / distanceSquared);
+        auto solidAngle = 2 * Util::pi * (1 - cosThetaMax);
+
+        return 1 / solidAngle;
+    }
+
+    vec3 random(const point3& origin) const override {
+        vec3 direction = centers[0] - origin;
+        auto distanceSquared = direction.length_squared();
+        if (distanceSquared <= radius * radius)
+            return random_unit_vector();
+
+        onb uvw(direction);
+        return uvw.local(random_to_sphere(radius, distanceSquared));
+    }
+
+    double area() const override { return 4 * Util::pi * radius * radius; }
+
+    shared_ptr<material> get_material() const override { return mat; }
+
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -88,6 +158,15 @@ public:
         v = theta * Util::invPi;
     }
 
+    void get_sphere_partials(double u, double v, vec3& dpdu, vec3& dpdv) const {
+        // Derivatives of the point at (u, v) for the parameterization of get_sphere_uv.
+        auto phi = 2 * Util::pi * u;
+        auto theta = Util::pi * v;
+
+        dpdu = 2 * Util::pi * radius * vec3(sin(phi) * sin(theta), 0, cos(phi) * sin(theta));
+        dpdv = Util::pi * radius * vec3(-cos(phi) * cos(theta), sin(theta), sin(phi) * cos(theta));
+    }
+
 private:
 
     double radius;
@@ -95,7 +174,6 @@ private:
     bool isMoving;
     std::vector<point3> centers;
     aabb bbox;
-    TransformMatrix worldToLocal, localToWorld;
 
     point3 center(double time) const {
         // Linearly interpolate from center1 to center2 according to time, where t=0 yields
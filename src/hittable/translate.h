@@ -3,42 +3,63 @@
 
 #include "Hittable.h"
 #include "../common.h"
-#include "../math/transform.h"
+#include "../math/affine.h"
 
 class trs : public Hittable {
 public:
     trs(shared_ptr<Hittable> p, const TransformMatrix& m)
-        : object(p), localToWorld(m)
+        : object(p), transform(m)
     {
-        localToWorld.inverse(worldToLocal);
-        bbox = localToWorld(object->bounding_box());
+        bbox = transform.bounds(object->bounding_box());
     }
 
     trs(shared_ptr<Hittable> p)
-        : object(p), localToWorld(), worldToLocal()
+        : object(p)
     {
         bbox = object->bounding_box();
     }
 
+    //  Moves the object, its bounds follow (a bvhNode over it needs a refit)
+    void set_transform(const TransformMatrix& m) {
+        transform = AffineTransform(m);
+        bbox = transform.bounds(object->bounding_box());
+    }
+
     bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
-        // Move the ray backwards by the offset
-        ray rLocal = worldToLocal(ray(r.origin(), r.direction(), r.time()));
- 
-        // Determine where (if any) an intersection occurs along the offset ray
-        if (!object->hit(rLocal, rayT, rec))
-            return false;
+        if (transform.is_identity())
+            return object->hit(r, rayT, rec);
 
-        // Move the intersection point forwards by the offset
-        rec.p = localToWorld(rec.p);
+        // Intersect in local space, t is the same along both rays
+        if (!object->hit(transform.inverse(r), rayT, rec))
+            return false;
 
+        to_world(transform, rec);
         return true;
     }
 
+    //  t is the same along both rays, so the object's own (closed form) range applies as is
+    bool hit_interval(const ray& r, interval rayT, interval& inside) const override {
+        return object->hit_interval(transform.is_identity() ? r : transform.inverse(r), rayT, inside);
+    }
+
+    //  Moves a hit found along transform.inverse(r) back to world space
+    static void to_world(const AffineTransform& transform, HitRecord& rec) {
+        rec.p = transform.point(rec.p, rec.pError, rec.pError);
+        rec.normal = unit_vector(transform.normal(rec.normal));
+        rec.dpdu = transform.vector(rec.dpdu);
+        rec.dpdv = transform.vector(rec.dpdv);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    void children(std::vector<shared_ptr<Hittable>>& parts,
+        std::vector<shared_ptr<Hittable>>& transformed) const override {
+        (transform.is_identity() ? parts : transformed).push_back(object);
+    }
+
 private:
     shared_ptr<Hittable> object;
-    TransformMatrix worldToLocal, localToWorld;
+    AffineTransform transform;
     aabb bbox;
 };
 
@@ -79,9 +79,9 @@ public:
             && dot(cross(vertices[0] - vertices[2], intersectPoint - vertices[2]), plane.normal) <= 0) {
 
             rec.t = t;
-            rec.p = intersectPoint;
             vec3 outwardNormal = plane.normal;
             rec.set_face_normal(r, outwardNormal);
+            rec.p = triangle_point(vertices[0], vertices[1], vertices[2], r.at(t), rec.pError);
             rec.mat = mat;
 
             return true;
@@ -1,6 +1,8 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <algorithm>
+#include <functional>
 #include <vector>
 
 #include "common.h"
@@ -10,9 +12,10 @@
 
 class HitRecord;
 
+//  Differentials are only set by specular bounces, see reflect_differentials
 struct ScatteredRay {
     double coeff;
-    ray r;
+    RayDifferential r;
 
     ScatteredRay(ray _r) : coeff(1.0), r(_r) {};
 
@@ -21,23 +24,67 @@ struct ScatteredRay {
 
 typedef std::vector < ScatteredRay > ScatteredRays;
 
+//  Carry the ray differentials of r_in through a mirror bounce, the surface being treated as
+//  locally flat. Diffuse bounces drop them, their lookups use the finest texture level.
+inline void reflect_differentials(const RayDifferential& r_in, const HitRecord& rec, RayDifferential& scattered) {
+    if (!r_in.has_differentials() || rec.dpdx.near_zero())
+        return;
+
+    scattered.set_differentials(rec.p + rec.dpdx, reflect(r_in.rx_direction(), rec.normal),
+        rec.p + rec.dpdy, reflect(r_in.ry_direction(), rec.normal));
+}
+
+inline void refract_differentials(const RayDifferential& r_in, const HitRecord& rec, double etaiOverEtat,
+    RayDifferential& scattered) {
+    if (!r_in.has_differentials() || rec.dpdx.near_zero())
+        return;
+
+    scattered.set_differentials(
+        rec.p + rec.dpdx, refract(unit_vector(r_in.rx_direction()), rec.normal, etaiOverEtat),
+        rec.p + rec.dpdy, refract(unit_vector(r_in.ry_direction()), rec.normal, etaiOverEtat));
+}
+
 class material {
 public:
     virtual ~material() = default;
 
     virtual bool scatter(
-        const ray& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered) const = 0;
+        const RayDifferential& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered) const = 0;
 
     virtual color emitted(double u, double v, const point3& p) const {
         return color(0, 0, 0);
     }
+
+    //  Solid angle density of `scatter` producing `scattered`. Zero for delta (specular) materials,
+    //  which can not be combined with light sampling.
+    virtual double scattering_pdf(const ray& r_in, const HitRecord& rec, const ray& scattered) const {
+        return 0;
+    }
+
+    //  True for phase functions, whose hits are scattering events inside a medium, not surfaces
+    virtual bool is_volumetric() const {
+        return false;
+    }
+
+    //  Texture `scatter` takes its attenuation from, for materials whose albedo can be looked up
+    //  ahead of time by an AlbedoBatch
+    virtual const texture* albedo_texture() const {
+        return nullptr;
+    }
+
+    //  scatter, with the value of albedo_texture at the hit already known
+    virtual bool scatter_with_albedo(const RayDifferential& r_in, const HitRecord& rec, const color& albedo,
+        color& attenuation, ScatteredRays& scattered) const {
+        return scatter(r_in, rec, attenuation, scattered);
+    }
 };
 
 class plain : public material {
 public:
     plain(const color& a) : plainColor(a) {}
 
-    bool scatter(const ray& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered) const override {
+    bool scatter(const RayDifferential& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
+        const override {
 
         attenuation = plainColor;
 
@@ -54,19 +101,34 @@ class lambertian : public material {
     lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
     lambertian(shared_ptr<texture> a) : albedo(a) {}
 
-    bool scatter(const ray& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
+    bool scatter(const RayDifferential& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
     const override {
+        return scatter_with_albedo(r_in, rec, albedo->filtered_value(rec.u, rec.v, rec.p, rec.texture_footprint()),
+            attenuation, scattered);
+    }
+
+    bool scatter_with_albedo(const RayDifferential& r_in, const HitRecord& rec, const color& albedoValue,
+        color& attenuation, ScatteredRays& scattered) const override {
         auto scatter_direction = rec.normal + random_unit_vector();
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
-        scattered = ScatteredRays{ ScatteredRay(ray(rec.p, scatter_direction, r_in.time())) };
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        scattered = ScatteredRays{ ScatteredRay(rec.spawn_ray(scatter_direction, r_in.time())) };
+        attenuation = albedoValue;
         return true;
     }
 
+    double scattering_pdf(const ray& r_in, const HitRecord& rec, const ray& scattered) const override {
+        auto cosTheta = dot(rec.normal, unit_vector(scattered.direction()));
+        return cosTheta < 0 ? 0 : cosTheta * Util::invPi;
+    }
+
+    const texture* albedo_texture() const override {
+        return albedo.get();
+    }
+
   private:
     shared_ptr<texture> albedo;
 };
@@ -75,12 +137,13 @@ class metal : public material {
 public:
     metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    bool scatter(const ray& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
+    bool scatter(const RayDifferential& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
         const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         //  TODO : another method other than fuzz?
         vec3 direction = reflected + fuzz * random_unit_vector();
-        scattered = ScatteredRays{ ScatteredRay(ray(rec.p, direction, r_in.time())) };
+        scattered = ScatteredRays{ ScatteredRay(rec.spawn_ray(direction, r_in.time())) };
+        reflect_differentials(r_in, rec, scattered[0].r);
         attenuation = albedo;
         //  Check if scattered direction is inside surface ( according to fuzz direction )
         return (dot(direction, rec.normal) > 0);
@@ -95,7 +158,7 @@ class dielectric : public material {
 public:
     dielectric(double index_of_refraction) : ir(index_of_refraction), isRoughlyScattering(true) {}
 
-    bool scatter(const ray& r_in, const HitRecord& rec, color& attenuation, std::vector<ScatteredRay>& scattered)
+    bool scatter(const RayDifferential& r_in, const HitRecord& rec, color& attenuation, std::vector<ScatteredRay>& scattered)
         const override {
         attenuation = color(1.0, 1.0, 1.0);
         //  Why?
@@ -111,22 +174,29 @@ public:
 
         if (isRoughlyScattering) {
             vec3 direction;
-            if (!canRefract || fresnelReflectance > 0.5)
+            bool isReflected = !canRefract || fresnelReflectance > 0.5;
+            if (isReflected)
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-            scattered = ScatteredRays{ ScatteredRay(ray(rec.p, direction, r_in.time())) };
+            scattered = ScatteredRays{ ScatteredRay(rec.spawn_ray(direction, r_in.time())) };
+            if (isReflected)
+                reflect_differentials(r_in, rec, scattered[0].r);
+            else
+                refract_differentials(r_in, rec, refraction_ratio, scattered[0].r);
         }
         else {
             vec3 reflectDirection = reflect(unit_direction, rec.normal);
             scattered = ScatteredRays{ ScatteredRay(!canRefract? 1.0 : fresnelReflectance, 
-                ray(rec.p, reflectDirection, r_in.time())) };
+                rec.spawn_ray(reflectDirection, r_in.time())) };
+            reflect_differentials(r_in, rec, scattered[0].r);
 
             if (canRefract) {
                 vec3 refractDirection = refract(unit_direction, rec.normal, refraction_ratio);
-                scattered.push_back( ScatteredRay(1.0 - fresnelReflectance, ray(rec.p, refractDirection,
+                scattered.push_back( ScatteredRay(1.0 - fresnelReflectance, rec.spawn_ray(refractDirection,
                     r_in.time())) );
+                refract_differentials(r_in, rec, refraction_ratio, scattered[1].r);
             }
         }
        
@@ -155,13 +225,21 @@ public:
     Isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
     Isotropic(shared_ptr<texture> a) : albedo(a) {}
 
-    bool scatter(const ray& r_in, const HitRecord& rec, color& attenuation, std::vector<ScatteredRay>& scattered)
+    bool scatter(const RayDifferential& r_in, const HitRecord& rec, color& attenuation, std::vector<ScatteredRay>& scattered)
         const override {
-        scattered = ScatteredRays{ ScatteredRay(ray(rec.p, random_unit_vector(), r_in.time())) };
+        scattered = ScatteredRays{ ScatteredRay(rec.spawn_ray(random_unit_vector(), r_in.time())) };
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    double scattering_pdf(const ray& r_in, const HitRecord& rec, const ray& scattered) const override {
+        return 1 / (4 * Util::pi);
+    }
+
+    bool is_volumetric() const override {
+        return true;
+    }
+
 private:
     shared_ptr<texture> albedo;
 };
@@ -171,7 +249,7 @@ public:
     DiffuseLight(shared_ptr<texture> a) : emit(a) {}
     DiffuseLight(color c) : emit(make_shared<solid_color>(c)) {}
 
-    bool scatter(const ray& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
+    bool scatter(const RayDifferential& r_in, const HitRecord& rec, color& attenuation, ScatteredRays& scattered)
         const override {
         return false;
     }
@@ -184,4 +262,53 @@ private:
     shared_ptr<texture> emit;
 };
 
-#endif
\ No newline at end of file
+/*
+    Albedo lookups of many hits evaluated together : lanes are grouped by texture, so each texture
+    is dispatched once per group with all of its lookups in SoA form, rather than once per hit.
+*/
+class AlbedoBatch {
+public:
+    void clear() {
+        lookups.clear();
+        textures.clear();
+    }
+
+    int size() const { return lookups.size(); }
+
+    //  Queues the albedo of `rec` and returns its lane, or -1 if its material has no albedo texture
+    int add(const HitRecord& rec) {
+        const texture* tex = rec.mat ? rec.mat->albedo_texture() : nullptr;
+        if (tex == nullptr)
+            return -1;
+
+        textures.push_back(tex);
+        return lookups.add(rec.u, rec.v, rec.p, rec.texture_footprint());
+    }
+
+    //  out[lane] receives the albedo of every queued lane
+    void evaluate(std::vector<color>& out) const {
+        int count = lookups.size();
+        out.resize(count);
+
+        std::vector<int> order(count);
+        for (int i = 0; i < count; ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+            return std::less<const texture*>()(textures[a], textures[b]);
+        });
+
+        for (int first = 0; first < count; ) {
+            int last = first + 1;
+            while (last < count && textures[order[last]] == textures[order[first]])
+                ++last;
+            textures[order[first]]->values(lookups, &order[first], last - first, out.data());
+            first = last;
+        }
+    }
+
+private:
+    TextureBatch lookups;
+    std::vector<const texture*> textures;  // Texture of each lane
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include <stdexcept>
+
+#include "../common.h"
+#include "../hittable/aabb.h"
+#include "transform.h"
+
+/*
+    Affine transform as the 3x4 matrix it really is, stored with its inverse and its normal
+    matrix (transposed inverse of the linear part), all computed once. Points, vectors and normals
+    go through a few multiply-adds, with no perspective divide; callers can check is_identity
+    once and skip transforming altogether.
+*/
+template <typename T>
+class BasicAffineTransform {
+public:
+    BasicAffineTransform() : identity(true) {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = inv[i][j] = (i == j) ? 1 : 0;
+    }
+
+    //  Affine part of `t` (its last column is assumed to be 0, 0, 0, 1)
+    explicit BasicAffineTransform(const BasicTransformMatrix<T>& t) {
+        basic_mat4<T> matrix = t.mat();
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = matrix(j, i);
+        invert();
+    }
+
+    bool is_identity() const { return identity; }
+
+    //  Local to world
+
+    basic_vec3<T> point(const basic_vec3<T>& p) const {
+        return apply(m, p) + basic_vec3<T>(m[0][3], m[1][3], m[2][3]);
+    }
+
+    basic_vec3<T> vector(const basic_vec3<T>& v) const {
+        return apply(m, v);
+    }
+
+    //  Not normalized
+    basic_vec3<T> normal(const basic_vec3<T>& n) const {
+        return basic_vec3<T>(
+            inv[0][0] * n.x() + inv[1][0] * n.y() + inv[2][0] * n.z(),
+            inv[0][1] * n.x() + inv[1][1] * n.y() + inv[2][1] * n.z(),
+            inv[0][2] * n.x() + inv[1][2] * n.y() + inv[2][2] * n.z());
+    }
+
+    //  point(p), with in pErrorOut a bound on its error when p is only known within +-pError
+    basic_vec3<T> point(const basic_vec3<T>& p, basic_vec3<T> pError, basic_vec3<T>& pErrorOut) const {
+        for (int i = 0; i < 3; ++i) {
+            T valueSum = fabs(m[i][0] * p.x()) + fabs(m[i][1] * p.y()) + fabs(m[i][2] * p.z()) + fabs(m[i][3]);
+            T errorSum = fabs(m[i][0]) * pError.x() + fabs(m[i][1]) * pError.y() + fabs(m[i][2]) * pError.z();
+            pErrorOut[i] = Util::gamma(3) * valueSum + (1 + Util::gamma(3)) * errorSum;
+        }
+        return point(p);
+    }
+
+    //  Bounds of the 8 transformed corners of `box`
+    basic_aabb<T> bounds(const basic_aabb<T>& box) const {
+        basic_aabb<T> result;
+        for (int corner = 0; corner < 8; ++corner) {
+            basic_vec3<T> p = point(basic_vec3<T>(
+                (corner & 1) ? box.x.max : box.x.min,
+                (corner & 2) ? box.y.max : box.y.min,
+                (corner & 4) ? box.z.max : box.z.min));
+            result = basic_aabb<T>(result, basic_aabb<T>(p, p));
+        }
+        return result;
+    }
+
+    //  World to local
+
+    basic_vec3<T> inverse_point(const basic_vec3<T>& p) const {
+        return apply(inv, p) + basic_vec3<T>(inv[0][3], inv[1][3], inv[2][3]);
+    }
+
+    basic_vec3<T> inverse_vector(const basic_vec3<T>& v) const {
+        return apply(inv, v);
+    }
+
+    //  The ray in local space, with the same parameter t along it
+    basic_ray<T> inverse(const basic_ray<T>& r) const {
+        return basic_ray<T>(inverse_point(r.origin()), inverse_vector(r.direction()), r.time());
+    }
+
+    basic_ray_differential<T> inverse(const basic_ray_differential<T>& r) const {
+        basic_ray_differential<T> result(inverse(static_cast<const basic_ray<T>&>(r)));
+        if (r.has_differentials())
+            result.set_differentials(inverse_point(r.rx_origin()), inverse_vector(r.rx_direction()),
+                inverse_point(r.ry_origin()), inverse_vector(r.ry_direction()));
+        return result;
+    }
+
+private:
+    T m[3][4];    // Rows of the forward transform, translation in the last column
+    T inv[3][4];  // Same for the inverse, whose transposed linear part is the normal matrix
+    bool identity;
+
+    static basic_vec3<T> apply(const T (&a)[3][4], const basic_vec3<T>& v) {
+        return basic_vec3<T>(
+            a[0][0] * v.x() + a[0][1] * v.y() + a[0][2] * v.z(),
+            a[1][0] * v.x() + a[1][1] * v.y() + a[1][2] * v.z(),
+            a[2][0] * v.x() + a[2][1] * v.y() + a[2][2] * v.z());
+    }
+
+    void invert() {
+        identity = true;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                identity = identity && m[i][j] == ((i == j) ? 1 : 0);
+
+        //  Inverse of the linear part from its cofactors, then the translation brought back
+        T c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        T c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        T c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        T det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+        if (det == 0)
+            throw std::runtime_error("Singular transform");
+        T invDet = 1 / det;
+
+        inv[0][0] = c00 * invDet;
+        inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+        inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        inv[1][0] = c01 * invDet;
+        inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+        inv[2][0] = c02 * invDet;
+        inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+        inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+        basic_vec3<T> t = apply(inv, basic_vec3<T>(m[0][3], m[1][3], m[2][3]));
+        inv[0][3] = -t.x();
+        inv[1][3] = -t.y();
+        inv[2][3] = -t.z();
+    }
+};
+
+using AffineTransform = BasicAffineTransform<Util::Real>;
+
+#endif
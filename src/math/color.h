@@ -2,17 +2,46 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include <array>
 #include <iostream>
 
 #include "vec3.h"
 
 using color = vec3;
 
+//  Sums of the samples of a pixel are kept in double in both precisions
+using pixel_sum = basic_vec3<double>;
+
 inline double linear_to_gamma(double linearComponent)
 {
     return pow(linearComponent, 0.45);
 }
 
+inline float srgb_to_linear(unsigned char encoded) {
+    // Decodes an 8 bit sRGB component, through a table built on the first call.
+    static const std::array<float, 256> table = [] {
+        std::array<float, 256> t;
+        for (int i = 0; i < 256; ++i) {
+            double c = i / 255.0;
+            t[i] = static_cast<float>(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+        }
+        return t;
+    }();
+    return table[encoded];
+}
+
+inline unsigned char linear_to_srgb(double linear) {
+    // Encodes a linear component to 8 bit sRGB, rounding to the nearest code : the inverse of
+    // srgb_to_linear.
+    double c = fmin(fmax(linear, 0.0), 1.0);
+    double encoded = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1 / 2.4) - 0.055;
+    return static_cast<unsigned char>(encoded * 255 + 0.5);
+}
+
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline void write_color(std::ostream& out, color pixelColor) {
     
     // Apply the linear to gamma transform.
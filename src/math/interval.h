@@ -9,43 +9,44 @@
 // along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 //==============================================================================================
 
-class interval {
+template <typename T>
+class basic_interval {
 public:
-    double min, max;
+    T min, max;
 
-    interval() : min(Util::infinity), max(-Util::infinity) {} // Default interval is universe
+    basic_interval() : min(Util::infinity), max(-Util::infinity) {} // Default interval is universe
 
-    interval(double _min, double _max) : min(_min), max(_max) {}
+    basic_interval(T _min, T _max) : min(_min), max(_max) {}
 
-    interval(const interval& a, const interval& b)
+    basic_interval(const basic_interval& a, const basic_interval& b)
         : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
 
-    double size() const {
+    T size() const {
         return max - min;
     }
 
-    interval expand(double delta) const {
+    basic_interval expand(T delta) const {
         auto padding = delta / 2;
-        return interval(min - padding, max + padding);
+        return basic_interval(min - padding, max + padding);
     }
 
-    bool contains(double x) const {
+    bool contains(T x) const {
         return min <= x && x <= max;
     }
 
-    bool surrounds(double x) const {
+    bool surrounds(T x) const {
         return min < x && x < max;
     }
 
-    double clamp(double x) const {
+    T clamp(T x) const {
         if (x < min) return min;
         if (x > max) return max;
         return x;
     }
 
-    static const interval empty, universe;
+    static const basic_interval empty, universe;
 };
 
-
+using interval = basic_interval<Util::Real>;
 
 #endif
\ No newline at end of file
@@ -3,24 +3,25 @@
 
 #include <stdexcept>
 
-class mat4 {
+template <typename T>
+class basic_mat4 {
 
 public:
     
-    mat4() {
+    basic_mat4() {
     for (int i = 0; i < 4; ++i)
         for (int j = 0; j < 4; ++j)
             m[i][j] = (i == j) ? 1 : 0;
     }
     
-    mat4(const double mat[4][4]) {
+    basic_mat4(const T mat[4][4]) {
     for (int i = 0; i < 4; ++i)
         for (int j = 0; j < 4; ++j)
             m[i][j] = mat[i][j];
     }
 
-    mat4 operator+(const mat4& m) const {
-        mat4 r = *this;
+    basic_mat4 operator+(const basic_mat4& m) const {
+        basic_mat4 r = *this;
         for (int i = 0; i < 4; ++i)
             for (int j = 0; j < 4; ++j)
                 r.m[i][j] += m.m[i][j];
@@ -28,19 +29,19 @@ public:
     }
 
     
-    mat4 operator*(double s) const {
-        mat4 r = *this;
+    basic_mat4 operator*(T s) const {
+        basic_mat4 r = *this;
         for (int i = 0; i < 4; ++i)
             for (int j = 0; j < 4; ++j)
                 r.m[i][j] *= s;
         return r;
     }
 
-    mat4 operator/(double s) const {
+    basic_mat4 operator/(T s) const {
         
         if (s == 0)
             throw std::runtime_error( "Divide by zero" );
-        mat4 r = *this;
+        basic_mat4 r = *this;
         for (int i = 0; i < 4; ++i)
             for (int j = 0; j < 4; ++j)
                 r.m[i][j] /= s;
@@ -48,7 +49,7 @@ public:
     }
 
     
-    bool operator==(const mat4& m2) const {
+    bool operator==(const basic_mat4& m2) const {
         for (int i = 0; i < 4; ++i)
             for (int j = 0; j < 4; ++j)
                 if (m[i][j] != m2.m[i][j])
@@ -56,7 +57,7 @@ public:
         return true;
     }
 
-    bool operator!=(const mat4& m2) const {
+    bool operator!=(const basic_mat4& m2) const {
         for (int i = 0; i < 4; ++i)
             for (int j = 0; j < 4; ++j)
                 if (m[i][j] != m2.m[i][j])
@@ -65,7 +66,7 @@ public:
     }
 
     
-    bool operator<(const mat4& m2) const {
+    bool operator<(const basic_mat4& m2) const {
         for (int i = 0; i < 4; ++i)
             for (int j = 0; j < 4; ++j) {
                 if (m[i][j] < m2.m[i][j])
@@ -76,11 +77,13 @@ public:
         return false;
     }
 
-    mat4& operator*=(const mat4& m2)
+    basic_mat4& operator*=(const basic_mat4& m2)
     {
-        mat4 temp;
+        basic_mat4 temp;
         for (int i = 0; i < 4; ++i) {
             for (int j = 0; j < 4; ++j) {
+                // temp starts as the identity, not zero
+                temp.m[i][j] = 0;
                 for (int k = 0; k < 4; ++k) {
                     temp.m[i][j] += (m[i][k] * m2.m[k][j]);
                 }
@@ -89,7 +92,7 @@ public:
         return (*this = temp);
     }
 
-    mat4& operator*=(double num)
+    basic_mat4& operator*=(T num)
     {
         for (int i = 0; i < 4; ++i) {
             for (int j = 0; j < 4; ++j) {
@@ -99,10 +102,10 @@ public:
         return *this;
     }
    
-    double& operator()(int x, int y) { return m[x][y]; }
-    double operator()(int x, int y) const { return m[x][y]; }
+    T& operator()(int x, int y) { return m[x][y]; }
+    T operator()(int x, int y) const { return m[x][y]; }
 
-    double& operator[](const int idx) {
+    T& operator[](const int idx) {
         unsigned int row = idx / 4;
         unsigned int col = idx - (row * 4);
         return m[row][col];
@@ -110,13 +113,16 @@ public:
     }
 
 private:
-    double m[4][4];
+    T m[4][4];
 };
 
-inline mat4 operator*(const mat4& m1, const mat4& m2)
+using mat4 = basic_mat4<Util::Real>;
+
+template <typename T>
+inline basic_mat4<T> operator*(const basic_mat4<T>& m1, const basic_mat4<T>& m2)
 {
 
-    mat4 temp(m1);
+    basic_mat4<T> temp(m1);
     return (temp *= m2);
 }
 
@@ -0,0 +1,25 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <cstdint>
+
+//  Spreads the low 10 bits of v so that two zero bits separate each of them
+inline uint32_t expand_bits(uint32_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+//  30 bit Morton code of a point whose coordinates are normalized to [0, 1]
+inline uint32_t morton3(double x, double y, double z) {
+    auto quantize = [](double c) {
+        c = c * 1024;
+        return static_cast<uint32_t>(c < 0 ? 0 : (c > 1023 ? 1023 : c));
+    };
+    return (expand_bits(quantize(x)) << 2) | (expand_bits(quantize(y)) << 1) | expand_bits(quantize(z));
+}
+
+#endif
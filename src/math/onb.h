@@ -0,0 +1,55 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "../common.h"
+
+//  Orthonormal basis built around a single axis (w), used to orient sampled directions
+class onb {
+public:
+    onb() {}
+
+    onb(const vec3& n) { build_from_w(n); }
+
+    vec3 operator[](int i) const { return axis[i]; }
+
+    vec3 u() const { return axis[0]; }
+    vec3 v() const { return axis[1]; }
+    vec3 w() const { return axis[2]; }
+
+    vec3 local(double a, double b, double c) const {
+        return a * u() + b * v() + c * w();
+    }
+
+    vec3 local(const vec3& a) const {
+        return a.x() * u() + a.y() * v() + a.z() * w();
+    }
+
+    void build_from_w(const vec3& n) {
+        vec3 unitW = unit_vector(n);
+        vec3 a = (fabs(unitW.x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 v = unit_vector(cross(unitW, a));
+        vec3 u = cross(unitW, v);
+        axis[0] = u;
+        axis[1] = v;
+        axis[2] = unitW;
+    }
+
+private:
+    vec3 axis[3];
+};
+
+//  Direction (in local space, +z toward the sphere) uniformly distributed inside the cone
+//  subtended by a sphere of `radius` whose center is `distanceSquared` away
+inline vec3 random_to_sphere(double radius, double distanceSquared) {
+    auto r1 = Util::random_double();
+    auto r2 = Util::random_double();
+    auto z = 1 + r2 * (sqrt(1 - radius * radius / distanceSquared) - 1);
+
+    auto phi = 2 * Util::pi * r1;
+    auto x = cos(phi) * sqrt(1 - z * z);
+    auto y = sin(phi) * sqrt(1 - z * z);
+
+    return vec3(x, y, z);
+}
+
+#endif
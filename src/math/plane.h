@@ -19,9 +19,9 @@ public:
     bool hit_plane(const ray& r, interval rayT, double& t) const {
 
         // assuming vectors are all normalized
-        float denom = dot(this->normal, r.direction());
+        double denom = dot(this->normal, r.direction());
        
-        if (fabs(denom) > Util::epsilon) {
+        if (denom != 0) {
             vec3 p0l0 = this->point - r.origin();
             t = dot(p0l0, this->normal) / denom;
             return rayT.surrounds(t);
@@ -31,4 +31,17 @@ public:
     }
 };
 
+//  p, found on the plane of triangle v0 v1 v2 by a ray, rebuilt from its barycentric coordinates.
+//  Any of them that sum to one give a point of the plane, so the result is within pError of it.
+inline point3 triangle_point(const point3& v0, const point3& v1, const point3& v2, const point3& p, vec3& pError) {
+    vec3 n = cross(v1 - v0, v2 - v0);
+    double invArea = 1 / dot(n, n);
+    double b0 = dot(cross(v2 - v1, p - v1), n) * invArea;
+    double b1 = dot(cross(v0 - v2, p - v2), n) * invArea;
+    double b2 = 1 - b0 - b1;
+
+    pError = Util::gamma(7) * (abs(b0 * v0) + abs(b1 * v1) + abs(b2 * v2));
+    return b0 * v0 + b1 * v1 + b2 * v2;
+}
+
 #endif
\ No newline at end of file
@@ -11,31 +11,92 @@
 // along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 //==============================================================================================
 
+#include <limits>
+
 #include "vec3.h"
 
-class ray {
+template <typename T>
+class basic_ray {
 public:
-    ray() {}
+    basic_ray() {}
 
-    ray(const point3& origin, const vec3& direction) : orig(origin), dir(direction), tm(0)
+    basic_ray(const basic_vec3<T>& origin, const basic_vec3<T>& direction) : orig(origin), dir(direction), tm(0)
     {}
 
-    ray(const point3& origin, const vec3& direction, double time = 0.0)
+    basic_ray(const basic_vec3<T>& origin, const basic_vec3<T>& direction, T time = 0.0)
         : orig(origin), dir(direction), tm(time)
     {}
 
-    point3 origin() const { return orig; }
-    vec3 direction() const { return dir; }
-    double time() const { return tm; }
+    basic_vec3<T> origin() const { return orig; }
+    basic_vec3<T> direction() const { return dir; }
+    T time() const { return tm; }
 
-    point3 at(double t) const {
+    basic_vec3<T> at(T t) const {
         return orig + t * dir;
     }
 
 private:
-    point3 orig;
-    vec3 dir;
-    double tm;
+    basic_vec3<T> orig;
+    basic_vec3<T> dir;
+    T tm;
 };
 
+//  Ray with the rays through the neighbouring pixels in x and y, used to size texture filters.
+//  Only camera rays and their mirror and glass bounces carry them, everything else (shadow rays,
+//  rays moved into a primitive's space, path queues) is a plain ray.
+template <typename T>
+class basic_ray_differential : public basic_ray<T> {
+public:
+    basic_ray_differential() {}
+
+    //  Without differentials
+    basic_ray_differential(const basic_ray<T>& r) : basic_ray<T>(r) {}
+
+    void set_differentials(const basic_vec3<T>& rxOrigin, const basic_vec3<T>& rxDirection, const basic_vec3<T>& ryOrigin,
+        const basic_vec3<T>& ryDirection) {
+        rxOrig = rxOrigin;
+        rxDir = rxDirection;
+        ryOrig = ryOrigin;
+        ryDir = ryDirection;
+        hasDifferentials = true;
+    }
+
+    bool has_differentials() const { return hasDifferentials; }
+    basic_vec3<T> rx_origin() const { return rxOrig; }
+    basic_vec3<T> rx_direction() const { return rxDir; }
+    basic_vec3<T> ry_origin() const { return ryOrig; }
+    basic_vec3<T> ry_direction() const { return ryDir; }
+
+private:
+    bool hasDifferentials = false;
+    basic_vec3<T> rxOrig, ryOrig;
+    basic_vec3<T> rxDir, ryDir;
+};
+
+using ray = basic_ray<Util::Real>;
+using RayDifferential = basic_ray_differential<Util::Real>;
+
+//  Origin of a ray leaving a surface at p toward w. p is only known within +-pError (per
+//  component, as computed by the primitive's hit), so it is pushed along the normal n, to the
+//  side w points to, by the projection of that error box on n, then rounded away from the
+//  surface. The spawned ray can be traced from t = 0 without finding the surface it leaves,
+//  however large the scene coordinates.
+template <typename T>
+inline basic_vec3<T> offset_ray_origin(const basic_vec3<T>& p, const basic_vec3<T>& pError,
+    const basic_vec3<T>& n, const basic_vec3<T>& w) {
+
+    basic_vec3<T> offset = dot(abs(n), pError) * n;
+    if (dot(w, n) < 0)
+        offset = -offset;
+
+    basic_vec3<T> origin = p + offset;
+    for (int i = 0; i < 3; ++i) {
+        if (offset[i] > 0)
+            origin[i] = std::nextafter(origin[i], std::numeric_limits<T>::infinity());
+        else if (offset[i] < 0)
+            origin[i] = std::nextafter(origin[i], -std::numeric_limits<T>::infinity());
+    }
+    return origin;
+}
+
 #endif
\ No newline at end of file
@@ -3,49 +3,65 @@
 
 #include "../common.h"
 
-class TransformMatrix {
+template <typename T>
+class BasicTransformMatrix {
 
 public:
 
-	TransformMatrix() : m() {};
+	BasicTransformMatrix() : m() {};
 
-    TransformMatrix(mat4 matrix) : m(matrix) {};
+    BasicTransformMatrix(basic_mat4<T> matrix) : m(matrix) {};
 
-	mat4 mat() { return m; };
+	basic_mat4<T> mat() const { return m; };
 
-	inline TransformMatrix operator*(const TransformMatrix& t2) const  {
-		return TransformMatrix( m * t2.m);
+	inline BasicTransformMatrix operator*(const BasicTransformMatrix& t2) const  {
+		return BasicTransformMatrix( m * t2.m);
 	}
 
-    inline point3 operator()(const point3& p) const {
+    inline basic_vec3<T> operator()(const basic_vec3<T>& p) const {
        
-        double x = p.x(), y = p.y(), z = p.z();
-        double xp = m(0, 0) * x + m(1, 0) * y + m(2, 0) * z + m(3, 0);
-        double yp = m(0, 1) * x + m(1, 1) * y + m(2, 1) * z + m(3, 1);
-        double zp = m(0, 2) * x + m(1, 2) * y + m(2, 2) * z + m(3, 2);
-        double wp = m(0, 3) * x + m(1, 3) * y + m(2, 3) * z + m(3, 3);
-
-        if (wp == 1) return point3(xp, yp, zp);
-        else         return point3(xp, yp, zp) / wp;
+        T x = p.x(), y = p.y(), z = p.z();
+        T xp = m(0, 0) * x + m(1, 0) * y + m(2, 0) * z + m(3, 0);
+        T yp = m(0, 1) * x + m(1, 1) * y + m(2, 1) * z + m(3, 1);
+        T zp = m(0, 2) * x + m(1, 2) * y + m(2, 2) * z + m(3, 2);
+        T wp = m(0, 3) * x + m(1, 3) * y + m(2, 3) * z + m(3, 3);
+
+        if (wp == 1) return basic_vec3<T>(xp, yp, zp);
+        else         return basic_vec3<T>(xp, yp, zp) / wp;
     }
 
-    inline ray operator()(const ray& r) const {
-        point3 o = (*this)(r.origin());
-        vec3 d = (*this)(r.direction());
-        return ray(o, d, r.time() );
+    //  Directions are not translated
+    inline basic_vec3<T> vector(const basic_vec3<T>& v) const {
+        return basic_vec3<T>(m(0, 0) * v.x() + m(1, 0) * v.y() + m(2, 0) * v.z(),
+            m(0, 1) * v.x() + m(1, 1) * v.y() + m(2, 1) * v.z(),
+            m(0, 2) * v.x() + m(1, 2) * v.y() + m(2, 2) * v.z());
     }
 
-    inline aabb operator()( const aabb& bbox) const {
-        point3 max = (*this)(vec3(bbox.x.max, bbox.y.max, bbox.z.max));
-        point3 min = (*this)(vec3(bbox.x.min, bbox.y.min, bbox.z.min));
+    inline basic_ray<T> operator()(const basic_ray<T>& r) const {
+        basic_vec3<T> o = (*this)(r.origin());
+        basic_vec3<T> d = vector(r.direction());
+        return basic_ray<T>(o, d, r.time());
+    }
+
+    inline basic_ray_differential<T> operator()(const basic_ray_differential<T>& r) const {
+        basic_ray_differential<T> result((*this)(static_cast<const basic_ray<T>&>(r)));
+        if (r.has_differentials())
+            result.set_differentials((*this)(r.rx_origin()), vector(r.rx_direction()),
+                (*this)(r.ry_origin()), vector(r.ry_direction()));
+        return result;
+    }
+
+    inline basic_aabb<T> operator()( const basic_aabb<T>& bbox) const {
+        basic_vec3<T> max = (*this)(basic_vec3<T>(bbox.x.max, bbox.y.max, bbox.z.max));
+        basic_vec3<T> min = (*this)(basic_vec3<T>(bbox.x.min, bbox.y.min, bbox.z.min));
 
-        return aabb(min, max);
+        return basic_aabb<T>(min, max);
     }
 
-    bool inverse(TransformMatrix &out)
+    bool inverse(BasicTransformMatrix &out)
     {
-        mat4 invOut;
-        double inv[16], det;
+        basic_mat4<T> invOut;
+        T inv[16], det;
         int i;
 
         inv[0] = m[5] * m[10] * m[15] -
@@ -165,17 +181,17 @@ public:
         if (det == 0)
             return false;
 
-        double invDet = 1.0 / det;
+        T invDet = 1.0 / det;
 
         for (i = 0; i < 16; ++i)
             invOut[i] = inv[i] * invDet;
-        out = TransformMatrix(invOut);
+        out = BasicTransformMatrix(invOut);
         return true;
     }
 
-    void translate(vec3 t) {
+    void translate(basic_vec3<T> t) {
 
-        mat4 mat;
+        basic_mat4<T> mat;
         mat(3, 0) = t.x();
         mat(3, 1) = t.y();
         mat(3, 2) = t.z();
@@ -184,9 +200,9 @@ public:
     }
 
 
-    void scale(vec3 s) {
+    void scale(basic_vec3<T> s) {
 
-        mat4 mat;
+        basic_mat4<T> mat;
         mat(0, 0) = s.x();
         mat(1, 1) = s.y();
         mat(2, 2) = s.z();
@@ -194,10 +210,10 @@ public:
         m *= mat;
     }
 
-    void rotate_x(double radian) {
+    void rotate_x(T radian) {
 
-        double cosX = cos(radian), sinX = sin(radian);
-        mat4 mat;
+        T cosX = cos(radian), sinX = sin(radian);
+        basic_mat4<T> mat;
         mat(1, 1) = cosX;
         mat(1, 2) = -sinX;
         mat(2, 1) = sinX;
@@ -206,9 +222,9 @@ public:
         m *= mat;
     }
 
-    void rotate_y(double radian) {
-        double cosX = cos(radian), sinX = sin(radian);
-        mat4 mat;
+    void rotate_y(T radian) {
+        T cosX = cos(radian), sinX = sin(radian);
+        basic_mat4<T> mat;
         mat(0, 0) = cosX;
         mat(2, 0) = sinX;
         mat(0, 2) = -sinX;
@@ -217,13 +233,13 @@ public:
         m *= mat;
     }
 
-    void rotate_z(double radian) {
-        double cosX = cos(radian), sinX = sin(radian);
-        mat4 mat;
-        m(0, 0) = cosX;
-        m(1, 0) = -sinX;
-        m(0, 1) = sinX;
-        m(1, 1) = cosX;
+    void rotate_z(T radian) {
+        T cosX = cos(radian), sinX = sin(radian);
+        basic_mat4<T> mat;
+        mat(0, 0) = cosX;
+        mat(1, 0) = -sinX;
+        mat(0, 1) = sinX;
+        mat(1, 1) = cosX;
 
         m *= mat;
     }
@@ -231,12 +247,15 @@ public:
    
 
 private:
-	mat4 m;
+	basic_mat4<T> m;
 
 };
 
-inline std::ostream& operator<<(std::ostream& out, TransformMatrix& t) {
-    mat4 m = t.mat();
+using TransformMatrix = BasicTransformMatrix<Util::Real>;
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, BasicTransformMatrix<T>& t) {
+    basic_mat4<T> m = t.mat();
     return out << m(0, 0) << " " << m(1, 0) << " " << m(2, 0) << " " << m(3, 0) << std::endl
             << m(0, 1) << " " << m(1, 1) << " " << m(2, 1) << " " << m(3, 1) << std::endl
             << m(0, 2) << " " << m(1, 2) << " " << m(2, 2) << " " << m(3, 2) << std::endl
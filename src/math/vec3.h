@@ -4,52 +4,60 @@
 #include <cmath>
 #include <iostream>
 
-class vec3 {
+//  3 component vector of any scalar type T, vec3 below is the one of the renderer's precision
+template <typename T>
+class basic_vec3 {
 public:
-    double e[3];
+    typedef T scalar;
 
-    vec3() : e{ 0,0,0 } {}
-    vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+    T e[3];
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    basic_vec3() : e{ 0,0,0 } {}
+    basic_vec3(T e0, T e1, T e2) : e{ e0, e1, e2 } {}
 
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    //  Conversion between precisions
+    template <typename U>
+    basic_vec3(const basic_vec3<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
 
-    vec3& operator+=(const vec3& v) {
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+
+    basic_vec3 operator-() const { return basic_vec3(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
+
+    basic_vec3& operator+=(const basic_vec3& v) {
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
         return *this;
     }
 
-    vec3& operator*=(double t) {
+    basic_vec3& operator*=(T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    vec3& operator/=(double t) {
+    basic_vec3& operator/=(T t) {
         return *this *= 1 / t;
     }
 
-    double length() const {
+    T length() const {
         return std::sqrt(length_squared());
     }
 
-    static vec3 random() {
-        return vec3(Util::random_double(), Util::random_double(), Util::random_double());
+    static basic_vec3 random() {
+        return basic_vec3(Util::random_double(), Util::random_double(), Util::random_double());
     }
 
-    static vec3 random(double min, double max) {
-        return vec3(Util::random_double(min, max), Util::random_double(min, max), Util::random_double(min, max));
+    static basic_vec3 random(double min, double max) {
+        return basic_vec3(Util::random_double(min, max), Util::random_double(min, max), Util::random_double(min, max));
     }
 
-    double length_squared() const {
+    T length_squared() const {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
 
@@ -59,7 +67,7 @@ public:
         return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
     }
 
-    vec3& approx_zero() {
+    basic_vec3& approx_zero() {
         for (unsigned int i = 0; i < 3; ++i) {
             if (fabs(e[i]) < Util::epsilon)
                 e[i] = 0.0;
@@ -68,53 +76,71 @@ public:
     }
 };
 
+using vec3 = basic_vec3<Util::Real>;
+
 // point3 is just an alias for vec3, but useful for geometric clarity in the code.
 using point3 = vec3;
 
 
 // Vector Utility Functions
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const basic_vec3<T>& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator+(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator-(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator-(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+//  Scalars are not deduced, so any arithmetic type scales a vector of any precision
+template <typename T>
+inline basic_vec3<T> operator*(typename basic_vec3<T>::scalar t, const basic_vec3<T>& v) {
+    return basic_vec3<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& v, typename basic_vec3<T>::scalar t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+template <typename T>
+inline basic_vec3<T> operator/(basic_vec3<T> v, typename basic_vec3<T>::scalar t) {
     return (1 / t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+template <typename T>
+inline basic_vec3<T> abs(const basic_vec3<T>& v) {
+    return basic_vec3<T>(std::fabs(v.e[0]), std::fabs(v.e[1]), std::fabs(v.e[2]));
+}
+
+template <typename T>
+inline T dot(const basic_vec3<T>& u, const basic_vec3<T>& v) {
     return u.e[0] * v.e[0]
         + u.e[1] * v.e[1]
         + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+template <typename T>
+inline basic_vec3<T> cross(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
         u.e[2] * v.e[0] - u.e[0] * v.e[2],
         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline basic_vec3<T> unit_vector(basic_vec3<T> v) {
     return v / v.length();
 }
 
@@ -130,8 +156,9 @@ inline vec3 random_unit_vector() {
     return unit_vector(random_in_unit_sphere());
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 onUnitSphere = random_unit_vector();
+template <typename T>
+inline basic_vec3<T> random_on_hemisphere(const basic_vec3<T>& normal) {
+    basic_vec3<T> onUnitSphere = random_unit_vector();
     if (dot(onUnitSphere, normal) > 0.0) // In the same hemisphere as the normal
         return onUnitSphere;
     else
@@ -146,14 +173,16 @@ inline vec3 random_in_unit_disk() {
     }
 }
 
-inline vec3 reflect(const vec3& v, const vec3& n) {
+template <typename T>
+inline basic_vec3<T> reflect(const basic_vec3<T>& v, const basic_vec3<T>& n) {
     return v - 2 * dot(v, n) * n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etaiOverEtat) {
-    auto cosTheta = fmin(dot(-uv, n), 1.0);
-    vec3 rOutPerp = etaiOverEtat * (uv + cosTheta * n);
-    vec3 rOutParallel = -sqrt(fabs(1.0 - rOutPerp.length_squared())) * n;
+template <typename T>
+inline basic_vec3<T> refract(const basic_vec3<T>& uv, const basic_vec3<T>& n, double etaiOverEtat) {
+    T cosTheta = fmin(dot(-uv, n), T(1));
+    basic_vec3<T> rOutPerp = etaiOverEtat * (uv + cosTheta * n);
+    basic_vec3<T> rOutParallel = -sqrt(fabs(1 - rOutPerp.length_squared())) * n;
     return rOutPerp + rOutParallel;
 }
 
@@ -0,0 +1,314 @@
+#ifndef VEC4_H
+#define VEC4_H
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "vec3.h"
+
+namespace Simd {
+
+    //  Register of 4 lanes of T, and the few operations basic_vec4 is built on. This portable
+    //  version is plain arrays, the specializations below map onto SSE, AVX or NEON.
+    template <typename T>
+    struct Lanes {
+        struct alignas(4 * sizeof(T)) type { T e[4]; };
+
+        static type set(T x, T y, T z, T w) { return type{ { x, y, z, w } }; }
+        static type splat(T s) { return type{ { s, s, s, s } }; }
+        static T get(const type& a, int i) { return a.e[i]; }
+
+        static type add(const type& a, const type& b) {
+            return type{ { a.e[0] + b.e[0], a.e[1] + b.e[1], a.e[2] + b.e[2], a.e[3] + b.e[3] } };
+        }
+        static type sub(const type& a, const type& b) {
+            return type{ { a.e[0] - b.e[0], a.e[1] - b.e[1], a.e[2] - b.e[2], a.e[3] - b.e[3] } };
+        }
+        static type mul(const type& a, const type& b) {
+            return type{ { a.e[0] * b.e[0], a.e[1] * b.e[1], a.e[2] * b.e[2], a.e[3] * b.e[3] } };
+        }
+        static type div(const type& a, const type& b) {
+            return type{ { a.e[0] / b.e[0], a.e[1] / b.e[1], a.e[2] / b.e[2], a.e[3] / b.e[3] } };
+        }
+        static type min(const type& a, const type& b) {
+            return type{ { std::fmin(a.e[0], b.e[0]), std::fmin(a.e[1], b.e[1]), std::fmin(a.e[2], b.e[2]), std::fmin(a.e[3], b.e[3]) } };
+        }
+        static type max(const type& a, const type& b) {
+            return type{ { std::fmax(a.e[0], b.e[0]), std::fmax(a.e[1], b.e[1]), std::fmax(a.e[2], b.e[2]), std::fmax(a.e[3], b.e[3]) } };
+        }
+
+        //  (y, z, x, w)
+        static type yzx(const type& a) { return type{ { a.e[1], a.e[2], a.e[0], a.e[3] } }; }
+
+        //  Sum, smallest and largest of the 4 lanes
+        static T sum(const type& a) { return (a.e[0] + a.e[1]) + (a.e[2] + a.e[3]); }
+        static T hmin(const type& a) { return std::fmin(std::fmin(a.e[0], a.e[1]), std::fmin(a.e[2], a.e[3])); }
+        static T hmax(const type& a) { return std::fmax(std::fmax(a.e[0], a.e[1]), std::fmax(a.e[2], a.e[3])); }
+    };
+
+#if defined(__SSE2__) || defined(_M_X64)
+    template <>
+    struct Lanes<float> {
+        typedef __m128 type;
+
+        static type set(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+        static type splat(float s) { return _mm_set1_ps(s); }
+        static float get(const type& a, int i) {
+            alignas(16) float e[4];
+            _mm_store_ps(e, a);
+            return e[i];
+        }
+
+        static type add(const type& a, const type& b) { return _mm_add_ps(a, b); }
+        static type sub(const type& a, const type& b) { return _mm_sub_ps(a, b); }
+        static type mul(const type& a, const type& b) { return _mm_mul_ps(a, b); }
+        static type div(const type& a, const type& b) { return _mm_div_ps(a, b); }
+        static type min(const type& a, const type& b) { return _mm_min_ps(a, b); }
+        static type max(const type& a, const type& b) { return _mm_max_ps(a, b); }
+        static type yzx(const type& a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+        static float sum(const type& a) {
+            type pairs = _mm_add_ps(a, _mm_movehl_ps(a, a));
+            return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+        }
+        static float hmin(const type& a) {
+            type pairs = _mm_min_ps(a, _mm_movehl_ps(a, a));
+            return _mm_cvtss_f32(_mm_min_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+        }
+        static float hmax(const type& a) {
+            type pairs = _mm_max_ps(a, _mm_movehl_ps(a, a));
+            return _mm_cvtss_f32(_mm_max_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+        }
+    };
+
+#if defined(__AVX2__)
+    template <>
+    struct Lanes<double> {
+        typedef __m256d type;
+
+        static type set(double x, double y, double z, double w) { return _mm256_setr_pd(x, y, z, w); }
+        static type splat(double s) { return _mm256_set1_pd(s); }
+        static double get(const type& a, int i) {
+            alignas(32) double e[4];
+            _mm256_store_pd(e, a);
+            return e[i];
+        }
+
+        static type add(const type& a, const type& b) { return _mm256_add_pd(a, b); }
+        static type sub(const type& a, const type& b) { return _mm256_sub_pd(a, b); }
+        static type mul(const type& a, const type& b) { return _mm256_mul_pd(a, b); }
+        static type div(const type& a, const type& b) { return _mm256_div_pd(a, b); }
+        static type min(const type& a, const type& b) { return _mm256_min_pd(a, b); }
+        static type max(const type& a, const type& b) { return _mm256_max_pd(a, b); }
+        static type yzx(const type& a) { return _mm256_permute4x64_pd(a, _MM_SHUFFLE(3, 0, 2, 1)); }
+
+        static double sum(const type& a) {
+            __m128d pairs = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+        }
+        static double hmin(const type& a) {
+            __m128d pairs = _mm_min_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+            return _mm_cvtsd_f64(_mm_min_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+        }
+        static double hmax(const type& a) {
+            __m128d pairs = _mm_max_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+            return _mm_cvtsd_f64(_mm_max_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+        }
+    };
+#else
+    //  Without AVX2 the 4 doubles are two SSE2 registers, (x, y) and (z, w)
+    template <>
+    struct Lanes<double> {
+        struct type { __m128d xy, zw; };
+
+        static type set(double x, double y, double z, double w) { return type{ _mm_setr_pd(x, y), _mm_setr_pd(z, w) }; }
+        static type splat(double s) { return type{ _mm_set1_pd(s), _mm_set1_pd(s) }; }
+        static double get(const type& a, int i) {
+            alignas(16) double e[4];
+            _mm_store_pd(e, a.xy);
+            _mm_store_pd(e + 2, a.zw);
+            return e[i];
+        }
+
+        static type add(const type& a, const type& b) { return type{ _mm_add_pd(a.xy, b.xy), _mm_add_pd(a.zw, b.zw) }; }
+        static type sub(const type& a, const type& b) { return type{ _mm_sub_pd(a.xy, b.xy), _mm_sub_pd(a.zw, b.zw) }; }
+        static type mul(const type& a, const type& b) { return type{ _mm_mul_pd(a.xy, b.xy), _mm_mul_pd(a.zw, b.zw) }; }
+        static type div(const type& a, const type& b) { return type{ _mm_div_pd(a.xy, b.xy), _mm_div_pd(a.zw, b.zw) }; }
+        static type min(const type& a, const type& b) { return type{ _mm_min_pd(a.xy, b.xy), _mm_min_pd(a.zw, b.zw) }; }
+        static type max(const type& a, const type& b) { return type{ _mm_max_pd(a.xy, b.xy), _mm_max_pd(a.zw, b.zw) }; }
+        static type yzx(const type& a) { return type{ _mm_shuffle_pd(a.xy, a.zw, 1), _mm_shuffle_pd(a.xy, a.zw, 2) }; }
+
+        static double sum(const type& a) {
+            __m128d pairs = _mm_add_pd(a.xy, a.zw);
+            return _mm_cvtsd_f64(_mm_add_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+        }
+        static double hmin(const type& a) {
+            __m128d pairs = _mm_min_pd(a.xy, a.zw);
+            return _mm_cvtsd_f64(_mm_min_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+        }
+        static double hmax(const type& a) {
+            __m128d pairs = _mm_max_pd(a.xy, a.zw);
+            return _mm_cvtsd_f64(_mm_max_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+        }
+    };
+#endif
+
+#elif defined(__ARM_NEON)
+    template <>
+    struct Lanes<float> {
+        typedef float32x4_t type;
+
+        static type set(float x, float y, float z, float w) {
+            float e[4] = { x, y, z, w };
+            return vld1q_f32(e);
+        }
+        static type splat(float s) { return vdupq_n_f32(s); }
+        static float get(const type& a, int i) {
+            float e[4];
+            vst1q_f32(e, a);
+            return e[i];
+        }
+
+        static type add(const type& a, const type& b) { return vaddq_f32(a, b); }
+        static type sub(const type& a, const type& b) { return vsubq_f32(a, b); }
+        static type mul(const type& a, const type& b) { return vmulq_f32(a, b); }
+        static type div(const type& a, const type& b) {
+            float e[4], f[4];
+            vst1q_f32(e, a);
+            vst1q_f32(f, b);
+            return set(e[0] / f[0], e[1] / f[1], e[2] / f[2], e[3] / f[3]);
+        }
+        static type min(const type& a, const type& b) { return vminq_f32(a, b); }
+        static type max(const type& a, const type& b) { return vmaxq_f32(a, b); }
+        static type yzx(const type& a) {
+            float e[4];
+            vst1q_f32(e, a);
+            return set(e[1], e[2], e[0], e[3]);
+        }
+
+        static float sum(const type& a) {
+            float32x2_t pairs = vadd_f32(vget_low_f32(a), vget_high_f32(a));
+            return vget_lane_f32(vpadd_f32(pairs, pairs), 0);
+        }
+        static float hmin(const type& a) {
+            float32x2_t pairs = vmin_f32(vget_low_f32(a), vget_high_f32(a));
+            return vget_lane_f32(vpmin_f32(pairs, pairs), 0);
+        }
+        static float hmax(const type& a) {
+            float32x2_t pairs = vmax_f32(vget_low_f32(a), vget_high_f32(a));
+            return vget_lane_f32(vpmax_f32(pairs, pairs), 0);
+        }
+    };
+#endif
+}
+
+/*
+    3D vector held in a 4 lane SIMD register, the 4th lane staying at zero : sums, products,
+    dot and cross products are a few instructions each instead of a scalar loop. Meant for hot
+    loops working on many vectors, it converts to and from basic_vec3 at their boundaries.
+*/
+template <typename T>
+class basic_vec4 {
+    typedef Simd::Lanes<T> L;
+
+public:
+    typedef T scalar;
+
+    typename L::type v;
+
+    basic_vec4() : v(L::splat(0)) {}
+    basic_vec4(T x, T y, T z) : v(L::set(x, y, z, 0)) {}
+    explicit basic_vec4(const basic_vec3<T>& a) : v(L::set(a.x(), a.y(), a.z(), 0)) {}
+    explicit basic_vec4(const typename L::type& lanes) : v(lanes) {}
+
+    T x() const { return L::get(v, 0); }
+    T y() const { return L::get(v, 1); }
+    T z() const { return L::get(v, 2); }
+
+    basic_vec3<T> xyz() const { return basic_vec3<T>(x(), y(), z()); }
+
+    basic_vec4 operator-() const { return basic_vec4(L::sub(L::splat(0), v)); }
+
+    basic_vec4& operator+=(const basic_vec4& a) {
+        v = L::add(v, a.v);
+        return *this;
+    }
+
+    basic_vec4& operator*=(T t) {
+        v = L::mul(v, L::splat(t));
+        return *this;
+    }
+
+    T length_squared() const { return L::sum(L::mul(v, v)); }
+
+    T length() const { return std::sqrt(length_squared()); }
+};
+
+using vec4 = basic_vec4<Util::Real>;
+
+template <typename T>
+inline basic_vec4<T> operator+(const basic_vec4<T>& a, const basic_vec4<T>& b) {
+    return basic_vec4<T>(Simd::Lanes<T>::add(a.v, b.v));
+}
+
+template <typename T>
+inline basic_vec4<T> operator-(const basic_vec4<T>& a, const basic_vec4<T>& b) {
+    return basic_vec4<T>(Simd::Lanes<T>::sub(a.v, b.v));
+}
+
+template <typename T>
+inline basic_vec4<T> operator*(const basic_vec4<T>& a, const basic_vec4<T>& b) {
+    return basic_vec4<T>(Simd::Lanes<T>::mul(a.v, b.v));
+}
+
+template <typename T>
+inline basic_vec4<T> operator*(typename basic_vec4<T>::scalar t, const basic_vec4<T>& a) {
+    return basic_vec4<T>(Simd::Lanes<T>::mul(Simd::Lanes<T>::splat(t), a.v));
+}
+
+template <typename T>
+inline basic_vec4<T> operator*(const basic_vec4<T>& a, typename basic_vec4<T>::scalar t) {
+    return t * a;
+}
+
+template <typename T>
+inline basic_vec4<T> operator/(const basic_vec4<T>& a, typename basic_vec4<T>::scalar t) {
+    return (1 / t) * a;
+}
+
+template <typename T>
+inline T dot(const basic_vec4<T>& a, const basic_vec4<T>& b) {
+    return Simd::Lanes<T>::sum(Simd::Lanes<T>::mul(a.v, b.v));
+}
+
+template <typename T>
+inline basic_vec4<T> cross(const basic_vec4<T>& a, const basic_vec4<T>& b) {
+    // a x b = (a * b.yzx - a.yzx * b).yzx, the w lane stays 0
+    typedef Simd::Lanes<T> L;
+    return basic_vec4<T>(L::yzx(L::sub(L::mul(a.v, L::yzx(b.v)), L::mul(L::yzx(a.v), b.v))));
+}
+
+template <typename T>
+inline basic_vec4<T> unit_vector(const basic_vec4<T>& a) {
+    return a * (1 / a.length());
+}
+
+template <typename T>
+inline basic_vec4<T> reflect(const basic_vec4<T>& v, const basic_vec4<T>& n) {
+    return v - 2 * dot(v, n) * n;
+}
+
+template <typename T>
+inline basic_vec4<T> refract(const basic_vec4<T>& uv, const basic_vec4<T>& n, T etaiOverEtat) {
+    T cosTheta = fmin(dot(-uv, n), T(1));
+    basic_vec4<T> rOutPerp = etaiOverEtat * (uv + cosTheta * n);
+    basic_vec4<T> rOutParallel = -std::sqrt(fabs(1 - rOutPerp.length_squared())) * n;
+    return rOutPerp + rOutParallel;
+}
+
+#endif
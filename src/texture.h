@@ -1,16 +1,63 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <vector>
+
 #include "common.h"
 
+#include "tool/density.h"
 #include "tool/image.h"
 #include "tool/noise.h"
+#include "tool/textureCache.h"
+#include "tool/textureLoader.h"
+
+//  Inputs of many texture lookups in structure of arrays form, one lane per lookup
+struct TextureBatch {
+    std::vector<double> u, v;
+    std::vector<double> x, y, z;
+    std::vector<double> filterWidth;
+
+    int size() const { return static_cast<int>(u.size()); }
+
+    void clear() {
+        u.clear(); v.clear();
+        x.clear(); y.clear(); z.clear();
+        filterWidth.clear();
+    }
+
+    int add(double _u, double _v, const point3& p, double _filterWidth) {
+        u.push_back(_u);
+        v.push_back(_v);
+        x.push_back(p.x());
+        y.push_back(p.y());
+        z.push_back(p.z());
+        filterWidth.push_back(_filterWidth);
+        return size() - 1;
+    }
+
+    point3 point(int lane) const { return point3(x[lane], y[lane], z[lane]); }
+};
 
 class texture {
 public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    //  Lookup averaged over a footprint of `filterWidth` in (u, v), textures without any
+    //  prefiltering just return the point value
+    virtual color filtered_value(double u, double v, const point3& p, double filterWidth) const {
+        return value(u, v, p);
+    }
+
+    //  filtered_value of the `count` lanes of `batch` listed in `lanes`, written to out[lane].
+    //  Textures that can share work between lookups override it, the default just loops.
+    virtual void values(const TextureBatch& batch, const int* lanes, int count, color* out) const {
+        for (int i = 0; i < count; ++i) {
+            int l = lanes[i];
+            out[l] = filtered_value(batch.u[l], batch.v[l], batch.point(l), batch.filterWidth[l]);
+        }
+    }
 };
 
 class solid_color : public texture {
@@ -23,6 +70,11 @@ public:
         return color_value;
     }
 
+    void values(const TextureBatch& batch, const int* lanes, int count, color* out) const override {
+        for (int i = 0; i < count; ++i)
+            out[lanes[i]] = color_value;
+    }
+
 private:
     color color_value;
 };
@@ -39,52 +91,201 @@ public:
     {}
 
     color value(double u, double v, const point3& p) const override {
-        auto xInteger = static_cast<int>(std::floor(inv_scale * p.x()));
-        auto yInteger = static_cast<int>(std::floor(inv_scale * p.y()));
-        auto zInteger = static_cast<int>(std::floor(inv_scale * p.z()));
+        return is_even(p) ? even->value(u, v, p) : odd->value(u, v, p);
+    }
+
+    color filtered_value(double u, double v, const point3& p, double filterWidth) const override {
+        return is_even(p) ? even->filtered_value(u, v, p, filterWidth) : odd->filtered_value(u, v, p, filterWidth);
+    }
 
-        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+    //  Splits the lanes by square color first, so each child is called once for all of its lanes
+    void values(const TextureBatch& batch, const int* lanes, int count, color* out) const override {
+        std::vector<int> evenLanes, oddLanes;
+        evenLanes.reserve(count);
+        oddLanes.reserve(count);
 
-        return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+        for (int i = 0; i < count; ++i) {
+            int l = lanes[i];
+            if (is_even(batch.point(l)))
+                evenLanes.push_back(l);
+            else
+                oddLanes.push_back(l);
+        }
+
+        if (!evenLanes.empty())
+            even->values(batch, evenLanes.data(), static_cast<int>(evenLanes.size()), out);
+        if (!oddLanes.empty())
+            odd->values(batch, oddLanes.data(), static_cast<int>(oddLanes.size()), out);
     }
 
 private:
     double inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
+
+    bool is_even(const point3& p) const {
+        auto xInteger = static_cast<int>(std::floor(inv_scale * p.x()));
+        auto yInteger = static_cast<int>(std::floor(inv_scale * p.y()));
+        auto zInteger = static_cast<int>(std::floor(inv_scale * p.z()));
+
+        return (xInteger + yInteger + zInteger) % 2 == 0;
+    }
 };
 
 class image_texture : public texture {
 public:
-    image_texture(const char* filename) : image(filename){}
+    //  The image is only decoded at first use, or by TextureLoader::prefetch
+    image_texture(const char* filename) : image(TextureLoader::instance().request(filename)) {}
 
     color value(double u, double v, const point3& p) const override {
+        const Image& decoded = image->get();
+
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0, 1, 1);
-        
-        auto pixelColor = image.pixel_color(u, v);
+        if (decoded.height() <= 0) return color(0, 1, 1);
+
+        double pixelColor[3];
+        decoded.pixel_color(u, v, pixelColor);
+
+        return color(pixelColor[0], pixelColor[1], pixelColor[2]);
+    }
+
+    color filtered_value(double u, double v, const point3& p, double filterWidth) const override {
+        const Image& decoded = image->get();
+        if (decoded.height() <= 0) return color(0, 1, 1);
+
+        double pixelColor[3];
+        decoded.pixel_color(u, v, filterWidth, pixelColor);
 
         return color(pixelColor[0], pixelColor[1], pixelColor[2]);
     }
 
+    //  The image is resolved once for the whole batch
+    void values(const TextureBatch& batch, const int* lanes, int count, color* out) const override {
+        const Image& decoded = image->get();
+        double pixelColor[3];
+
+        for (int i = 0; i < count; ++i) {
+            int l = lanes[i];
+            if (decoded.height() <= 0) {
+                out[l] = color(0, 1, 1);
+                continue;
+            }
+            decoded.pixel_color(batch.u[l], batch.v[l], batch.filterWidth[l], pixelColor);
+            out[l] = color(pixelColor[0], pixelColor[1], pixelColor[2]);
+        }
+    }
+
 private:
-    Image image;
+    shared_ptr<const LazyImage> image;
 
 };
 
+//  image_texture whose texels live in the shared TextureCache, for scenes with more texture data
+//  than memory
+class tiled_image_texture : public texture {
+public:
+    tiled_image_texture(const char* filename) : image(filename) {}
+
+    color value(double u, double v, const point3& p) const override {
+        return filtered_value(u, v, p, 0);
+    }
+
+    color filtered_value(double u, double v, const point3& p, double filterWidth) const override {
+        if (image.height() <= 0) return color(0, 1, 1);
+
+        double pixelColor[3];
+        image.pixel_color(u, v, filterWidth, pixelColor);
+
+        return color(pixelColor[0], pixelColor[1], pixelColor[2]);
+    }
+
+private:
+    TiledImage image;
+};
+
 class NoiseTexture : public texture {
 public:
 
-    NoiseTexture(double _freq, double _scale) : freq(_freq), scale(_scale) {}
+    //  Textures with the same seed share their noise tables
+    NoiseTexture(double _freq, double _scale, unsigned seed = 0) : noise(seed), scale(_scale), freq(_freq) {}
 
     color value(double u, double v, const point3& p) const override {
         auto s = freq * p;
-        return color(1, 1, 1) * scale * (1 + sin(s.z() + 10 * noise.turb(s)));
+        return color(1, 1, 1) * scale * (1 + sin(s.z() + 10 * turbulence(p)));
+    }
+
+    //  Lanes outside the baked region go through the batched Perlin kernel together
+    void values(const TextureBatch& batch, const int* lanes, int count, color* out) const override {
+        std::vector<double> x, y, z, turb(count);
+        std::vector<int> noiseLanes;
+        x.reserve(count); y.reserve(count); z.reserve(count);
+
+        for (int i = 0; i < count; ++i) {
+            int l = lanes[i];
+            if (baked && bakedRegion.x.contains(batch.x[l]) && bakedRegion.y.contains(batch.y[l])
+                && bakedRegion.z.contains(batch.z[l])) {
+                turb[i] = baked->density(batch.point(l));
+                continue;
+            }
+            noiseLanes.push_back(i);
+            x.push_back(freq * batch.x[l]);
+            y.push_back(freq * batch.y[l]);
+            z.push_back(freq * batch.z[l]);
+        }
+
+        std::vector<double> evaluated(noiseLanes.size());
+        noise.turb(x.data(), y.data(), z.data(), evaluated.data(), static_cast<int>(noiseLanes.size()));
+        for (size_t n = 0; n < noiseLanes.size(); ++n)
+            turb[noiseLanes[n]] = evaluated[n];
+
+        for (int i = 0; i < count; ++i) {
+            int l = lanes[i];
+            out[l] = color(1, 1, 1) * scale * (1 + sin(freq * batch.z[l] + 10 * turb[i]));
+        }
+    }
+
+    //  Precomputes the turbulence inside `region` (world space) on a grid of `voxelsPerUnit`
+    //  voxels per unit, looked up trilinearly from then on. Outside of it the noise is still
+    //  evaluated, so the region only needs to cover where most hits land.
+    void bake(const aabb& region, double voxelsPerUnit) {
+        int n[3];
+        for (int a = 0; a < 3; ++a)
+            n[a] = static_cast<int>(fmax(1.0, ceil(region.axis(a).size() * voxelsPerUnit)));
+
+        std::vector<float> data(static_cast<size_t>(n[0]) * n[1] * n[2]);
+        std::vector<double> x(n[0]), y(n[0]), z(n[0]), row(n[0]);
+
+        //  A row of voxel centers at a time, through the batched kernel
+        for (int k = 0; k < n[2]; ++k)
+            for (int j = 0; j < n[1]; ++j) {
+                for (int i = 0; i < n[0]; ++i) {
+                    x[i] = freq * (region.x.min + (i + 0.5) * region.x.size() / n[0]);
+                    y[i] = freq * (region.y.min + (j + 0.5) * region.y.size() / n[1]);
+                    z[i] = freq * (region.z.min + (k + 0.5) * region.z.size() / n[2]);
+                }
+                noise.turb(x.data(), y.data(), z.data(), row.data(), n[0]);
+
+                float* dst = &data[(static_cast<size_t>(k) * n[1] + j) * n[0]];
+                for (int i = 0; i < n[0]; ++i)
+                    dst[i] = static_cast<float>(row[i]);
+            }
+
+        baked = make_shared<GridDensity>(region, n[0], n[1], n[2], data);
+        bakedRegion = region;
     }
 
 private:
     perlin noise;
     double scale;
     double freq;
+    shared_ptr<GridDensity> baked;
+    aabb bakedRegion;
+
+    double turbulence(const point3& p) const {
+        if (baked && bakedRegion.x.contains(p.x()) && bakedRegion.y.contains(p.y())
+            && bakedRegion.z.contains(p.z()))
+            return baked->density(p);
+        return noise.turb(freq * p);
+    }
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,247 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../common.h"
+#include "../hittable/bvh.h"
+#include "mappedFile.h"
+
+/*
+    BVH cache file (.rtbv)
+
+        header
+        Node nodes[numNodes]    depth first from the root, see bvhNode::flatten
+        int32 items[numItems]   the leaves' objects, as indices into the scene's list
+
+    A scene's tree, flattened over the scene's list of objects. Files are named after a hash of the
+    objects' count and bounds, so a scene whose geometry did not change finds its tree again on
+    later runs, and traces it straight from the memory mapped file : nothing is sorted, allocated
+    or linked, and only the nodes rays reach are paged in. The objects themselves (with their
+    materials) still come from the scene code.
+*/
+namespace BvhCache {
+
+    const char magic[4] = { 'R', 'T', 'B', 'V' };
+    const uint32_t version = 2;
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t sceneHash;
+        uint32_t numObjects;
+        uint32_t numNodes;
+        uint32_t scalarSize;    // sizeof(Util::Real) of the build that wrote the file
+        uint32_t numItems;
+    };
+
+    //  A FlatNode and its bounds, leaves holding items[first, first + count)
+    struct Node {
+        Util::Real boundsMin[3];
+        Util::Real boundsMax[3];
+        int32_t first;
+        int32_t count;
+        int32_t axis;
+        int32_t padding;
+    };
+
+    //  64 bit FNV-1a over the objects' count, motion keys and bounds
+    inline uint64_t scene_hash(const std::vector<shared_ptr<Hittable>>& objects) {
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&hash](const void* data, size_t bytes) {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < bytes; ++i) {
+                hash ^= p[i];
+                hash *= 1099511628211ull;
+            }
+        };
+
+        uint64_t count = objects.size();
+        add(&count, sizeof(count));
+        for (const auto& object : objects) {
+            int keys = object->motion_keys();
+            add(&keys, sizeof(keys));
+            for (int k = 0; k < keys; ++k) {
+                aabb box = keys == 1 ? object->bounding_box() : object->key_bounding_box(k);
+                Util::Real bounds[6] = { box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max };
+                add(bounds, sizeof(bounds));
+            }
+        }
+        return hash;
+    }
+
+    inline void write(const std::string& filename, uint64_t sceneHash, const std::vector<shared_ptr<Hittable>>& objects,
+        const bvhNode& tree) {
+
+        std::vector<aabb> bounds;
+        std::vector<FlatNode> nodes;
+        std::vector<int32_t> items;
+        tree.flatten(objects, bounds, nodes, items);
+
+        std::ofstream file(filename, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Could not write " + filename);
+
+        Header header = {};
+        std::memcpy(header.magic, magic, 4);
+        header.version = version;
+        header.sceneHash = sceneHash;
+        header.numObjects = static_cast<uint32_t>(objects.size());
+        header.numNodes = static_cast<uint32_t>(bounds.size());
+        header.scalarSize = sizeof(Util::Real);
+        header.numItems = static_cast<uint32_t>(items.size());
+        file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            Node node = {};
+            for (int a = 0; a < 3; ++a) {
+                node.boundsMin[a] = bounds[i].axis(a).min;
+                node.boundsMax[a] = bounds[i].axis(a).max;
+            }
+            node.first = nodes[i].first;
+            node.count = nodes[i].count;
+            node.axis = nodes[i].axis;
+            file.write(reinterpret_cast<const char*>(&node), sizeof(Node));
+        }
+        file.write(reinterpret_cast<const char*>(items.data()), items.size() * sizeof(int32_t));
+        if (!file)
+            throw std::runtime_error("Could not write " + filename);
+    }
+}
+
+/*
+    Tree of a .rtbv file traced in place from its memory mapping, over the objects it was written for
+*/
+class MappedBvh : public Hittable {
+public:
+    //  Throws if the header does not match `_objects` or the file is short. The nodes and items
+    //  themselves are checked as traversal reaches them, see node and item.
+    MappedBvh(const std::string& filename, uint64_t sceneHash, const std::vector<shared_ptr<Hittable>>& _objects)
+        : file(filename), objects(_objects) {
+        if (file.size() < sizeof(BvhCache::Header))
+            throw std::runtime_error(filename + " is not a BVH cache");
+
+        BvhCache::Header header;
+        std::memcpy(&header, file.begin(), sizeof(BvhCache::Header));
+        if (std::memcmp(header.magic, BvhCache::magic, 4) != 0 || header.version != BvhCache::version
+            || header.scalarSize != sizeof(Util::Real))
+            throw std::runtime_error(filename + " is not a supported BVH cache");
+        if (header.sceneHash != sceneHash || header.numObjects != objects.size() || header.numNodes == 0)
+            throw std::runtime_error(filename + " was written for other objects");
+        size_t nodeBytes = static_cast<size_t>(header.numNodes) * sizeof(BvhCache::Node);
+        if (file.size() < sizeof(BvhCache::Header) + nodeBytes + static_cast<size_t>(header.numItems) * sizeof(int32_t))
+            throw std::runtime_error(filename + " is truncated");
+
+        nodes = reinterpret_cast<const BvhCache::Node*>(file.begin() + sizeof(BvhCache::Header));
+        items = reinterpret_cast<const int32_t*>(file.begin() + sizeof(BvhCache::Header) + nodeBytes);
+        numNodes = header.numNodes;
+        numItems = header.numItems;
+
+        bbox = node_box(0);
+    }
+
+    bool hit(const ray& r, interval rayT, HitRecord& rec) const override {
+        return FlatBvh::hit([this](int i) { return node(i); }, [this](int i) { return node_box(i); },
+            [this, &r](int i, interval t, HitRecord& itemRec) {
+                const Hittable* object = item(i);
+                return object != nullptr && object->hit(r, t, itemRec);
+            },
+            r, rayT, rec);
+    }
+
+    double transmittance(const ray& r, interval rayT) const override {
+        return FlatBvh::transmittance([this](int i) { return node(i); }, [this](int i) { return node_box(i); },
+            [this, &r, rayT](int i) {
+                const Hittable* object = item(i);
+                return object != nullptr ? object->transmittance(r, rayT) : 1.0;
+            },
+            r, rayT);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void children(std::vector<shared_ptr<Hittable>>& parts,
+        std::vector<shared_ptr<Hittable>>& /*transformed*/) const override {
+        parts.insert(parts.end(), objects.begin(), objects.end());
+    }
+
+    size_t node_count() const { return numNodes; }
+
+private:
+    MappedFile file;
+    std::vector<shared_ptr<Hittable>> objects;
+    const BvhCache::Node* nodes;
+    const int32_t* items;
+    size_t numNodes;
+    size_t numItems;
+    aabb bbox;
+
+    //  Checking every node up front would page in the whole file. Instead each one is checked as
+    //  it is read : children after their parent and leaves within the items, so traversal never
+    //  leaves the arrays and always ends, whatever the file holds. A damaged node reads as an
+    //  empty leaf.
+    FlatNode node(int index) const {
+        const BvhCache::Node& n = nodes[index];
+        bool valid = n.count > 0
+            ? n.first >= 0 && static_cast<size_t>(n.first) + n.count <= numItems
+            : n.count == 0 && n.axis >= 0 && n.axis < 3 && static_cast<size_t>(index) + 1 < numNodes
+                && n.first > index && static_cast<size_t>(n.first) < numNodes;
+        return valid ? FlatNode{ n.first, n.count, n.axis } : FlatNode{ 0, -1, 0 };
+    }
+
+    //  Object of item i, nullptr when out of range
+    const Hittable* item(int i) const {
+        int32_t object = items[i];
+        return object >= 0 && static_cast<size_t>(object) < objects.size() ? objects[object].get() : nullptr;
+    }
+
+    aabb node_box(int index) const {
+        const BvhCache::Node& node = nodes[index];
+        return aabb(interval(node.boundsMin[0], node.boundsMax[0]), interval(node.boundsMin[1], node.boundsMax[1]),
+            interval(node.boundsMin[2], node.boundsMax[2]));
+    }
+};
+
+namespace BvhCache {
+
+    //  Tree over `list` from the cache in `directory`. When it holds none for these objects, the
+    //  tree comes from `build`, and is written to the cache for the next run.
+    inline shared_ptr<Hittable> load_or_build(const HittableList& list, const std::string& directory,
+        const std::function<shared_ptr<bvhNode>()>& build) {
+
+        uint64_t hash = scene_hash(list.objects);
+        char name[32];
+        std::snprintf(name, sizeof(name), "bvh_%016llx.rtbv", static_cast<unsigned long long>(hash));
+        std::string filename = directory + "/" + name;
+
+        try {
+            auto tree = make_shared<MappedBvh>(filename, hash, list.objects);
+            std::clog << "BVH read from " << filename << std::endl;
+            return tree;
+        }
+        catch (const std::runtime_error&) {
+            //  Missing, stale or damaged : rebuilt below
+        }
+
+        auto tree = build();
+        try {
+            write(filename, hash, list.objects, *tree);
+            std::clog << "BVH written to " << filename << std::endl;
+        }
+        catch (const std::runtime_error& error) {
+            //  The cache only saves time, rendering goes on without it
+            std::clog << error.what() << std::endl;
+        }
+        return tree;
+    }
+}
+
+#endif
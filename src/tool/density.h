@@ -0,0 +1,177 @@
+#ifndef DENSITY_H
+#define DENSITY_H
+
+#include <functional>
+#include <vector>
+
+#include "../common.h"
+#include "../hittable/aabb.h"
+#include "noise.h"
+
+/*
+    Spatially varying density of a participating medium, in world space. max_density must bound
+    density everywhere, it is used as the majorant for delta and ratio tracking.
+*/
+class DensityField {
+public:
+    virtual ~DensityField() = default;
+
+    virtual double density(const point3& p) const = 0;
+
+    virtual double max_density() const = 0;
+
+    //  Bound of the density inside a region, the global bound by default : fields that can do
+    //  better override it so that majorant grids can skip sparse areas
+    virtual double max_density(const aabb& /*region*/) const {
+        return max_density();
+    }
+};
+
+//  Dense voxel grid spanning `bounds`, trilinearly interpolated between voxel centers
+class GridDensity : public DensityField {
+public:
+    GridDensity(const aabb& _bounds, int _nx, int _ny, int _nz, const std::vector<float>& _data)
+        : bounds(_bounds), nx(_nx), ny(_ny), nz(_nz), data(_data) {
+
+        maxValue = 0;
+        for (float d : data)
+            maxValue = fmax(maxValue, d);
+    }
+
+    //  Samples `f` at every voxel center, e.g. to freeze a procedural field into a grid
+    GridDensity(const aabb& _bounds, int _nx, int _ny, int _nz, const std::function<double(const point3&)>& f)
+        : bounds(_bounds), nx(_nx), ny(_ny), nz(_nz), data(static_cast<size_t>(_nx) * _ny * _nz) {
+
+        maxValue = 0;
+        for (int z = 0; z < nz; ++z)
+            for (int y = 0; y < ny; ++y)
+                for (int x = 0; x < nx; ++x) {
+                    point3 p(bounds.x.min + (x + 0.5) * bounds.x.size() / nx,
+                        bounds.y.min + (y + 0.5) * bounds.y.size() / ny,
+                        bounds.z.min + (z + 0.5) * bounds.z.size() / nz);
+                    float d = static_cast<float>(fmax(0.0, f(p)));
+                    data[index(x, y, z)] = d;
+                    maxValue = fmax(maxValue, d);
+                }
+    }
+
+    double density(const point3& p) const override {
+        if (!bounds.x.contains(p.x()) || !bounds.y.contains(p.y()) || !bounds.z.contains(p.z()))
+            return 0;
+
+        //  Continuous voxel coordinates, voxel centers at integer + 0.5
+        double gx = (p.x() - bounds.x.min) / bounds.x.size() * nx - 0.5;
+        double gy = (p.y() - bounds.y.min) / bounds.y.size() * ny - 0.5;
+        double gz = (p.z() - bounds.z.min) / bounds.z.size() * nz - 0.5;
+
+        int x0 = static_cast<int>(floor(gx)), y0 = static_cast<int>(floor(gy)), z0 = static_cast<int>(floor(gz));
+        double fx = gx - x0, fy = gy - y0, fz = gz - z0;
+
+        double accum = 0;
+        for (int i = 0; i < 2; ++i)
+            for (int j = 0; j < 2; ++j)
+                for (int k = 0; k < 2; ++k)
+                    accum += (i * fx + (1 - i) * (1 - fx))
+                        * (j * fy + (1 - j) * (1 - fy))
+                        * (k * fz + (1 - k) * (1 - fz))
+                        * voxel(x0 + i, y0 + j, z0 + k);
+        return accum;
+    }
+
+    double max_density() const override { return maxValue; }
+
+    double max_density(const aabb& region) const override {
+        // Every voxel that takes part in the interpolation of a point inside region.
+        int lo[3], hi[3];
+        int n[3] = { nx, ny, nz };
+        for (int a = 0; a < 3; ++a) {
+            const interval& b = bounds.axis(a);
+            lo[a] = static_cast<int>(floor((region.axis(a).min - b.min) / b.size() * n[a] - 0.5));
+            hi[a] = static_cast<int>(floor((region.axis(a).max - b.min) / b.size() * n[a] - 0.5)) + 1;
+            lo[a] = Util::clamp(lo[a], 0, n[a] - 1);
+            hi[a] = Util::clamp(hi[a], 0, n[a] - 1);
+        }
+
+        double result = 0;
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x)
+                    result = fmax(result, data[index(x, y, z)]);
+        return result;
+    }
+
+    double voxel(int x, int y, int z) const {
+        x = Util::clamp(x, 0, nx - 1);
+        y = Util::clamp(y, 0, ny - 1);
+        z = Util::clamp(z, 0, nz - 1);
+        return data[index(x, y, z)];
+    }
+
+private:
+    aabb bounds;
+    int nx, ny, nz;
+    std::vector<float> data;
+    double maxValue;
+
+    size_t index(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * ny + y) * nx + x;
+    }
+};
+
+//  Perlin turbulence, the same field NoiseTexture uses, as a density
+class NoiseDensity : public DensityField {
+public:
+    NoiseDensity(double _freq, double _scale, int _depth = 3, unsigned seed = 0)
+        : noise(seed), freq(_freq), scale(_scale), depth(_depth) {}
+
+    double density(const point3& p) const override {
+        return fmin(scale * noise.turb(freq * p, depth), max_density());
+    }
+
+    double max_density() const override {
+        // |noise| <= 1, each octave halves the weight.
+        return scale * (2 - pow(0.5, depth - 1));
+    }
+
+    //  Bound over the region from the turbulence at the centers of boxes of about 1 / boxesPerCell
+    //  of the finest octave's lattice cell, plus each octave's variation_bound over them
+    double max_density(const aabb& region) const override {
+        double finest = freq * pow(2.0, depth - 1);
+        int parts[3];
+        for (int a = 0; a < 3; ++a)
+            parts[a] = Util::clamp(static_cast<int>(ceil(region.axis(a).size() * finest * boxesPerCell)), 1, maxBoxes);
+
+        double bound = 0;
+        for (int x = 0; x < parts[0]; ++x)
+            for (int y = 0; y < parts[1]; ++y)
+                for (int z = 0; z < parts[2]; ++z) {
+                    int index[3] = { x, y, z };
+                    point3 lo, hi;
+                    for (int a = 0; a < 3; ++a) {
+                        lo[a] = region.axis(a).min + region.axis(a).size() * index[a] / parts[a];
+                        hi[a] = region.axis(a).min + region.axis(a).size() * (index[a] + 1) / parts[a];
+                    }
+
+                    double variation = 0, weight = 1, octaveFreq = freq;
+                    for (int i = 0; i < depth; ++i) {
+                        variation += weight * noise.variation_bound(aabb(octaveFreq * lo, octaveFreq * hi));
+                        weight *= 0.5;
+                        octaveFreq *= 2;
+                    }
+                    bound = fmax(bound, noise.turb(freq * (lo + hi) / 2, depth) + variation);
+                }
+        return fmin(scale * bound, max_density());
+    }
+
+private:
+    //  Smaller boxes give tighter bounds, at the cost of building majorant grids
+    static const int boxesPerCell = 4;
+    static const int maxBoxes = 16;  // Per axis, coarser boxes only loosen the bound
+
+    perlin noise;
+    double freq;
+    double scale;
+    int depth;
+};
+
+#endif
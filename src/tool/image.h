@@ -11,21 +11,33 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "../util.h"
+#include "../math/color.h"
 #include "../../lib/stb_image.h"
 
 enum class InterpolateMethod { Nearest, Linear };
 
 enum class WrapMethod { Repeat, MirroedRepeat, ClampToEdge, ClampToBorder };
 
+/*
+    Texels are decoded once at load : sRGB bytes become linear floats, stored as packed RGBA so a
+    texel is one 16 byte load. The wrap and interpolation modes are fixed at construction and
+    pick a specialized lookup function, so no per sample branching on them is left.
+*/
 class Image {
 public:
-    Image(InterpolateMethod _interpolateMethod = InterpolateMethod::Nearest) : data(nullptr), 
-        colorScale( 1.0 / 255.0), interpolateMethod(_interpolateMethod) {}
+    Image(InterpolateMethod _interpolateMethod = InterpolateMethod::Nearest,
+        WrapMethod _wrapMethod = WrapMethod::ClampToEdge)
+        : interpolateMethod(_interpolateMethod), wrapMethod(_wrapMethod) {
+        select_lookups();
+    }
 
-    Image(const char* imageFilepath, InterpolateMethod _interpolateMethod = InterpolateMethod::Nearest): 
-        colorScale(1.0 / 255.0), interpolateMethod(_interpolateMethod) {
+    Image(const char* imageFilepath, InterpolateMethod _interpolateMethod = InterpolateMethod::Nearest,
+        WrapMethod _wrapMethod = WrapMethod::ClampToEdge)
+        : interpolateMethod(_interpolateMethod), wrapMethod(_wrapMethod) {
         // Loads image data from the specified file. If the RTW_IMAGES environment variable is
         // defined, looks only in that directory for the image file. If the image was not found,
         // searches for the specified image file first from the current directory, then in the
@@ -43,134 +55,256 @@ public:
 
     }
 
-    ~Image() { 
-        stbi_image_free(data);
-    }
-
-    bool load(const std::string filename, int numChannel = 3) {
-        bytesPerPixel = numChannel;
+    bool load(const std::string filename) {
         // Loads image data from the given file name. Returns true if the load succeeded.
-        auto n = bytesPerPixel; // Dummy out parameter: original components per pixel
-        data = stbi_load(filename.c_str(), &imageWidth, &imageHeight, &n, bytesPerPixel);
-        bytesPerScanline = imageWidth * bytesPerPixel;
+        int width, height;
+        auto n = 3; // Dummy out parameter: original components per pixel
+        unsigned char* data = stbi_load(filename.c_str(), &width, &height, &n, 3);
+
+        levels.clear();
+        if (data != nullptr) {
+            MipLevel base;
+            base.width = width;
+            base.height = height;
+            base.texels.resize(static_cast<size_t>(width) * height * 4);
+            for (size_t i = 0, count = static_cast<size_t>(width) * height; i < count; ++i) {
+                base.texels[i * 4 + 0] = srgb_to_linear(data[i * 3 + 0]);
+                base.texels[i * 4 + 1] = srgb_to_linear(data[i * 3 + 1]);
+                base.texels[i * 4 + 2] = srgb_to_linear(data[i * 3 + 2]);
+                base.texels[i * 4 + 3] = 1.0f;
+            }
+            stbi_image_free(data);
+
+            levels.push_back(std::move(base));
+            build_mipmaps();
+        }
+
+        select_lookups();
         return data != nullptr;
     }
 
-    int width()  const { return (data == nullptr) ? 0 : imageWidth; }
-    int height() const { return (data == nullptr) ? 0 : imageHeight; }
+    static bool load_linear(const char* imageFilepath, std::vector<float>& pixels, int& width, int& height) {
+        // Loads linear floating point RGB data from the res/ directory. HDR files are kept as is,
+        // 8 bit formats are converted from sRGB by stb. Returns true if the load succeeded.
+        auto filename = std::string("res") + "/" + imageFilepath;
+        int n;
+        float* floatData = stbi_loadf(filename.c_str(), &width, &height, &n, 3);
+        if (floatData == nullptr) {
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            width = height = 0;
+            return false;
+        }
+
+        pixels.assign(floatData, floatData + static_cast<size_t>(width) * height * 3);
+        stbi_image_free(floatData);
+        return true;
+    }
+
+    int width()  const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+
+    //  Point lookup at the finest level (or magenta if no data)
+    void pixel_color(double u, double v, double out[3]) const {
+        (this->*pointLookup)(u, v, out);
+    }
+
+    //  Trilinear lookup : bilinear in the two mip levels around the one whose texels match
+    //  filterWidth (in uv units), then blended between them
+    void pixel_color(double u, double v, double filterWidth, double out[3]) const {
+        (this->*filteredLookup)(u, v, filterWidth, out);
+    }
+
+private:
+    struct MipLevel {
+        int width, height;
+        std::vector<float> texels;         // Linear RGBA, row major, top row first
+    };
+
+    typedef void (Image::*PointLookup)(double u, double v, double out[3]) const;
+    typedef void (Image::*FilteredLookup)(double u, double v, double filterWidth, double out[3]) const;
+
+    std::vector<MipLevel> levels;          // Level 0 is the full resolution image
+
+    InterpolateMethod interpolateMethod = InterpolateMethod::Nearest;
+    WrapMethod wrapMethod = WrapMethod::ClampToEdge;
+    PointLookup pointLookup;
+    FilteredLookup filteredLookup;
+
+    static constexpr double noDataColor[3] = { 1.0, 0.0, 1.0 };
+
+    void build_mipmaps() {
+        // Box filter each level down by two until a single texel is left.
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            const MipLevel& prev = levels.back();
+            int w = prev.width, h = prev.height;
+
+            MipLevel next;
+            next.width = w > 1 ? w / 2 : 1;
+            next.height = h > 1 ? h / 2 : 1;
+            next.texels.resize(static_cast<size_t>(next.width) * next.height * 4);
+
+            for (int y = 0; y < next.height; ++y)
+                for (int x = 0; x < next.width; ++x) {
+                    float* dst = &next.texels[(static_cast<size_t>(y) * next.width + x) * 4];
+                    for (int dy = 0; dy < 2; ++dy)
+                        for (int dx = 0; dx < 2; ++dx) {
+                            const float* src = texel(prev, Util::clamp(2 * x + dx, 0, w - 1),
+                                Util::clamp(2 * y + dy, 0, h - 1));
+                            for (int c = 0; c < 4; ++c)
+                                dst[c] += 0.25f * src[c];
+                        }
+                }
+
+            levels.push_back(std::move(next));
+        }
+    }
+
+    void select_lookups() {
+        if (levels.empty()) {
+            pointLookup = &Image::no_data;
+            filteredLookup = &Image::no_data_filtered;
+            return;
+        }
+
+        switch (wrapMethod) {
+            case WrapMethod::Repeat:        select_lookups<WrapMethod::Repeat>();           break;
+            case WrapMethod::MirroedRepeat: select_lookups<WrapMethod::MirroedRepeat>();    break;
+            case WrapMethod::ClampToEdge:   select_lookups<WrapMethod::ClampToEdge>();      break;
+            case WrapMethod::ClampToBorder: select_lookups<WrapMethod::ClampToBorder>();    break;
+        }
+    }
+
+    template <WrapMethod Wrap>
+    void select_lookups() {
+        if (interpolateMethod == InterpolateMethod::Nearest)
+            pointLookup = &Image::point_lookup<Wrap, InterpolateMethod::Nearest>;
+        else
+            pointLookup = &Image::point_lookup<Wrap, InterpolateMethod::Linear>;
+        filteredLookup = &Image::filtered_lookup<Wrap>;
+    }
 
-    double *normalizeColor(unsigned char* color) const {
-        double colorNorm[3];
-        
-        colorNorm[0] = color[0] * colorScale;
-        colorNorm[1] = color[1] * colorScale;
-        colorNorm[2] = color[2] * colorScale;
+    void no_data(double u, double v, double out[3]) const {
+        for (int c = 0; c < 3; ++c) out[c] = noDataColor[c];
+    }
 
-        return colorNorm;
+    void no_data_filtered(double u, double v, double filterWidth, double out[3]) const {
+        no_data(u, v, out);
     }
-    const double* pixel_color(double u, double v) const {
-        // Return the address of the $bytesPerPixel of the pixel at x,y (or magenta if no data).
-        
+
+    template <WrapMethod Wrap, InterpolateMethod Interpolate>
+    void point_lookup(double u, double v, double out[3]) const {
         // Flip Y
         v = 1 - v;
 
-        if (data == nullptr) return noDataColor;
-        
-        if (u < 0 || u > 1 || v < 0 || v > 1) {
-
-            if (wrapMethod == WrapMethod::ClampToEdge) {
-                u = Util::clamp(u, 0.0, 1.0);
-                v = Util::clamp(v, 0.0, 1.0);
-            }
-            else if (wrapMethod == WrapMethod::Repeat) {
-                u = u - static_cast<int>(u);
-                v = v - static_cast<int>(v);
-            }
-            else if (wrapMethod == WrapMethod::MirroedRepeat) {
-                u = 1 - (u - static_cast<int>(u));
-                v = 1 - (v - static_cast<int>(v));
-            }
-            else if (wrapMethod == WrapMethod::ClampToBorder) {
-                return noDataColor;
-            }
+        if (!wrap<Wrap>(u, v)) {
+            no_data(u, v, out);
+            return;
         }
 
-        if (interpolateMethod == InterpolateMethod::Nearest) {
-            int x = static_cast<int>(u * width());
-            int y = static_cast<int>(v * height());
+        if (Interpolate == InterpolateMethod::Nearest)
+            nearest(levels[0], u, v, out);
+        else
+            bilerp(levels[0], u, v, out);
+    }
 
-            x = Util::clamp(x, 0, imageWidth - 1);
-            y = Util::clamp(y, 0, imageHeight - 1);
+    template <WrapMethod Wrap>
+    void filtered_lookup(double u, double v, double filterWidth, double out[3]) const {
+        v = 1 - v;
+
+        if (!wrap<Wrap>(u, v)) {
+            no_data(u, v, out);
+            return;
+        }
+
+        int numLevels = static_cast<int>(levels.size());
+        int size = levels[0].width > levels[0].height ? levels[0].width : levels[0].height;
+        double level = log2(fmax(filterWidth * size, 1e-8));
 
-            unsigned char* color = data + y * bytesPerScanline + x * bytesPerPixel;
-           
-            return normalizeColor(color);
+        if (level <= 0) {
+            bilerp(levels[0], u, v, out);
+            return;
         }
-        else if (interpolateMethod == InterpolateMethod::Linear) {
-            double x = u * width();
-            double y = v * height();
-           
-            unsigned int xInt = static_cast<int>(x), yInt = static_cast<int>(y);
-
-            //  At the border, just return like a Nearest
-            if ( xInt == 0 || yInt == 0 
-                || xInt == imageWidth - 1 || yInt == imageHeight - 1)
-                return normalizeColor(data + yInt * bytesPerScanline + xInt * bytesPerPixel);
-
-            int neighDir[2];
-            neighDir[0] = x - xInt < 0.5 ? 1 : -1;
-            neighDir[1] = y - yInt < 0.5 ? 1 : -1;
-
-            unsigned char* color00, * color01, * color10, * color11;
-            color00 = data + yInt * bytesPerScanline + xInt * bytesPerPixel;
-            color01 = data + yInt * bytesPerScanline + (xInt + neighDir[0]) * bytesPerPixel;
-            color10 = data + (yInt + neighDir[1]) * bytesPerScanline + xInt * bytesPerPixel;
-            color11 = data + (yInt + neighDir[1]) * bytesPerScanline + (xInt + neighDir[0]) * bytesPerPixel;
-           
-            double dist[2];
-            if (neighDir[0] == 1)
-                dist[0] = x - xInt - 0.5;
-            else
-                dist[0] = 0.5 - (x - xInt);
-
-            if (neighDir[1] == 1)
-                dist[1] = y - yInt - 0.5;
-            else
-                dist[1] = 0.5 - (y - yInt);
-
-            double pow2Dist[2] = { dist[0] * dist[0], dist[1] * dist[1] };
-            //  pow( 1-x, 2 )
-            double pow2OneMinusDist[2] = { 1 - 2 * dist[0] + pow2Dist[0], 1 - 2 * dist[1] + pow2Dist[1] };
-
-            double w00, w01, w10, w11;
-            w00 = sqrt(pow2Dist[0]          + pow2Dist[1]);
-            w01 = sqrt(pow2OneMinusDist[0]  + pow2Dist[1]);
-            w10 = sqrt(pow2Dist[0]          + pow2OneMinusDist[1]);
-            w11 = sqrt(pow2OneMinusDist[0]  + pow2OneMinusDist[1]);
-
-            double wTotal = 1 / (w00 + w01 + w10 + w11);
-            double multiplier = colorScale * wTotal;
-            double color[3];
-            color[0] = (w00 * color00[0] + w01 * color01[0] + w10 * color10[0] + w11 * color11[0]) * multiplier;
-            color[1] = (w00 * color00[1] + w01 * color01[1] + w10 * color10[1] + w11 * color11[1]) * multiplier;
-            color[2] = (w00 * color00[2] + w01 * color01[2] + w10 * color10[2] + w11 * color11[2]) * multiplier;
- 
-            return color ;
+        if (level >= numLevels - 1) {
+            bilerp(levels[numLevels - 1], u, v, out);
+            return;
         }
+
+        int lower = static_cast<int>(level);
+        double blend = level - lower;
+        double colorLower[3], colorUpper[3];
+        bilerp(levels[lower], u, v, colorLower);
+        bilerp(levels[lower + 1], u, v, colorUpper);
+        for (int c = 0; c < 3; ++c)
+            out[c] = (1 - blend) * colorLower[c] + blend * colorUpper[c];
     }
 
-private:
-    int bytesPerPixel;
-    unsigned char* data;
-    int imageWidth, imageHeight;
-    int bytesPerScanline;
-    double colorScale;
+    static const float* texel(const MipLevel& level, int x, int y) {
+        return &level.texels[(static_cast<size_t>(y) * level.width + x) * 4];
+    }
 
-    static constexpr double noDataColor[3] = { 1.0, 0.0, 1.0 };
+    static void nearest(const MipLevel& level, double u, double v, double out[3]) {
+        int x = Util::clamp(static_cast<int>(u * level.width), 0, level.width - 1);
+        int y = Util::clamp(static_cast<int>(v * level.height), 0, level.height - 1);
 
-    InterpolateMethod interpolateMethod = InterpolateMethod::Nearest;
-    WrapMethod wrapMethod = WrapMethod::ClampToEdge;
+        const float* c = texel(level, x, y);
+        out[0] = c[0];
+        out[1] = c[1];
+        out[2] = c[2];
+    }
+
+    static void bilerp(const MipLevel& level, double u, double v, double out[3]) {
+        int w = level.width, h = level.height;
+
+        //  Texel centers sit at half integers
+        double x = u * w - 0.5, y = v * h - 0.5;
+        int x0 = static_cast<int>(floor(x)), y0 = static_cast<int>(floor(y));
+        float fx = static_cast<float>(x - x0), fy = static_cast<float>(y - y0);
+
+        int x1 = Util::clamp(x0 + 1, 0, w - 1), y1 = Util::clamp(y0 + 1, 0, h - 1);
+        x0 = Util::clamp(x0, 0, w - 1);
+        y0 = Util::clamp(y0, 0, h - 1);
+
+        const float* c00 = texel(level, x0, y0);
+        const float* c10 = texel(level, x1, y0);
+        const float* c01 = texel(level, x0, y1);
+        const float* c11 = texel(level, x1, y1);
+
+        float w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy), w01 = (1 - fx) * fy, w11 = fx * fy;
+        float result[4];
+        for (int c = 0; c < 4; ++c)
+            result[c] = w00 * c00[c] + w10 * c10[c] + w01 * c01[c] + w11 * c11[c];
 
+        out[0] = result[0];
+        out[1] = result[1];
+        out[2] = result[2];
+    }
+
+    template <WrapMethod Wrap>
+    static bool wrap(double& u, double& v) {
+        // Bring (u, v) back into [0, 1], false if it falls on the border.
+        if (u >= 0 && u <= 1 && v >= 0 && v <= 1)
+            return true;
+
+        if (Wrap == WrapMethod::ClampToEdge) {
+            u = Util::clamp(u, 0.0, 1.0);
+            v = Util::clamp(v, 0.0, 1.0);
+        }
+        else if (Wrap == WrapMethod::Repeat) {
+            u = u - floor(u);
+            v = v - floor(v);
+        }
+        else if (Wrap == WrapMethod::MirroedRepeat) {
+            //  Period of 2, going back down on the second half
+            u = u - 2 * floor(u / 2);
+            v = v - 2 * floor(v / 2);
+            u = u > 1 ? 2 - u : u;
+            v = v > 1 ? 2 - v : v;
+        }
+        else if (Wrap == WrapMethod::ClampToBorder) {
+            return false;
+        }
+        return true;
+    }
 };
 
 // Restore MSVC compiler warnings
@@ -0,0 +1,128 @@
+#ifndef MAJORANT_GRID_H
+#define MAJORANT_GRID_H
+
+#include <vector>
+
+#include "../common.h"
+#include "../hittable/aabb.h"
+#include "density.h"
+
+/*
+    Coarse grid storing the maximum density of each voxel. Tracking walks it voxel by voxel, so
+    free flights are sampled against a local majorant : empty voxels are skipped entirely and
+    thin ones are crossed in a few large steps.
+*/
+class MajorantGrid {
+public:
+    MajorantGrid() {}
+
+    MajorantGrid(const DensityField& field, const aabb& _bounds, int resolution)
+        : bounds(_bounds) {
+
+        for (int a = 0; a < 3; ++a)
+            res[a] = resolution;
+        voxels.resize(static_cast<size_t>(res[0]) * res[1] * res[2]);
+
+        for (int z = 0; z < res[2]; ++z)
+            for (int y = 0; y < res[1]; ++y)
+                for (int x = 0; x < res[0]; ++x) {
+                    int index[3] = { x, y, z };
+                    point3 lo, hi;
+                    for (int a = 0; a < 3; ++a) {
+                        lo[a] = bounds.axis(a).min + bounds.axis(a).size() * index[a] / res[a];
+                        hi[a] = bounds.axis(a).min + bounds.axis(a).size() * (index[a] + 1) / res[a];
+                    }
+                    voxels[offset(x, y, z)] = static_cast<float>(field.max_density(aabb(lo, hi)));
+                }
+    }
+
+    float lookup(int x, int y, int z) const { return voxels[offset(x, y, z)]; }
+
+    const aabb& grid_bounds() const { return bounds; }
+
+    int resolution(int axis) const { return res[axis]; }
+
+private:
+    aabb bounds;
+    int res[3] = { 0, 0, 0 };
+    std::vector<float> voxels;
+
+    size_t offset(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * res[1] + y) * res[0] + x;
+    }
+};
+
+/*
+    3D DDA over a MajorantGrid : returns, front to back, the ray segments [tMin, tMax] spent in
+    each voxel together with that voxel's majorant.
+*/
+class MajorantIterator {
+public:
+    MajorantIterator(const MajorantGrid& _grid, const ray& r, interval rayT)
+        : grid(_grid), tCurrent(rayT.min), tEnd(rayT.max) {
+
+        const aabb& bounds = grid.grid_bounds();
+        point3 p = r.at(rayT.min);
+        vec3 d = r.direction();
+
+        for (int a = 0; a < 3; ++a) {
+            int res = grid.resolution(a);
+            double voxelSize = bounds.axis(a).size() / res;
+
+            //  Starting voxel, clamped since the entry point sits on the boundary
+            voxel[a] = static_cast<int>((p[a] - bounds.axis(a).min) / voxelSize);
+            voxel[a] = Util::clamp(voxel[a], 0, res - 1);
+
+            if (d[a] == 0) {
+                nextCrossingT[a] = Util::infinity;
+                deltaT[a] = Util::infinity;
+                step[a] = 0;
+                voxelLimit[a] = -1;
+            }
+            else if (d[a] > 0) {
+                double nextBoundary = bounds.axis(a).min + (voxel[a] + 1) * voxelSize;
+                nextCrossingT[a] = rayT.min + (nextBoundary - p[a]) / d[a];
+                deltaT[a] = voxelSize / d[a];
+                step[a] = 1;
+                voxelLimit[a] = res;
+            }
+            else {
+                double nextBoundary = bounds.axis(a).min + voxel[a] * voxelSize;
+                nextCrossingT[a] = rayT.min + (nextBoundary - p[a]) / d[a];
+                deltaT[a] = -voxelSize / d[a];
+                step[a] = -1;
+                voxelLimit[a] = -1;
+            }
+        }
+    }
+
+    bool next(double& tMin, double& tMax, double& majorant) {
+        if (tCurrent >= tEnd)
+            return false;
+
+        //  Axis whose voxel boundary is crossed first
+        int axis = 0;
+        if (nextCrossingT[1] < nextCrossingT[axis]) axis = 1;
+        if (nextCrossingT[2] < nextCrossingT[axis]) axis = 2;
+
+        tMin = tCurrent;
+        tMax = fmin(nextCrossingT[axis], tEnd);
+        majorant = grid.lookup(voxel[0], voxel[1], voxel[2]);
+
+        tCurrent = tMax;
+        voxel[axis] += step[axis];
+        nextCrossingT[axis] += deltaT[axis];
+        if (voxel[axis] == voxelLimit[axis])
+            tCurrent = tEnd;
+
+        return true;
+    }
+
+private:
+    const MajorantGrid& grid;
+    double tCurrent, tEnd;
+    int voxel[3], step[3], voxelLimit[3];
+    double nextCrossingT[3], deltaT[3];
+};
+
+#endif
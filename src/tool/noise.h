@@ -1,27 +1,79 @@
 #ifndef NOISE_H
 #define NOISE_H
 
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+
 #include "../common.h"
+#include "../hittable/aabb.h"
+
+/*
+    Immutable lattice tables of one noise seed, shared by every perlin using that seed. The three
+    permutations are interleaved byte by byte, so the hashes of a lattice cell come from two
+    4 byte entries per axis. Gradients are floats padded to 16 bytes. Everything fits in 5 KB.
+*/
+struct PerlinTables {
+    static const int pointCount = 256;
+
+    alignas(64) uint8_t perm[pointCount][4];       // x, y, z permutations, then padding
+    alignas(64) float gradient[pointCount][4];     // Unit vectors, then padding
+
+    explicit PerlinTables(unsigned seed) {
+        // Own generator, so a seed always gives the same noise whatever else used rand().
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
 
-class perlin {
-public:
-    perlin() {
-        randVec = new vec3[pointCount];
         for (int i = 0; i < pointCount; ++i) {
-            randVec[i] = unit_vector(vec3::random(-1, 1));
+            float x, y, z, lengthSquared;
+            do {
+                x = uniform(rng);
+                y = uniform(rng);
+                z = uniform(rng);
+                lengthSquared = x * x + y * y + z * z;
+            } while (lengthSquared < 1e-6f || lengthSquared > 1);
+
+            float invLength = 1 / std::sqrt(lengthSquared);
+            gradient[i][0] = x * invLength;
+            gradient[i][1] = y * invLength;
+            gradient[i][2] = z * invLength;
+            gradient[i][3] = 0;
         }
 
-        permX = perlin_generate_perm();
-        permY = perlin_generate_perm();
-        permZ = perlin_generate_perm();
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int i = 0; i < pointCount; ++i)
+                perm[i][axis] = static_cast<uint8_t>(i);
+            for (int i = pointCount - 1; i > 0; --i) {
+                int target = std::uniform_int_distribution<int>(0, i)(rng);
+                uint8_t tmp = perm[i][axis];
+                perm[i][axis] = perm[target][axis];
+                perm[target][axis] = tmp;
+            }
+        }
+        for (int i = 0; i < pointCount; ++i)
+            perm[i][3] = 0;
     }
 
-    ~perlin() {
-        delete[] randVec;
-        delete[] permX;
-        delete[] permY;
-        delete[] permZ;
+    //  Tables of `seed`, built the first time that seed is asked for
+    static shared_ptr<const PerlinTables> get(unsigned seed) {
+        static std::map<unsigned, shared_ptr<const PerlinTables>> cache;
+        static std::mutex cacheMutex;
+
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = cache.find(seed);
+        if (it != cache.end())
+            return it->second;
+
+        auto tables = make_shared<const PerlinTables>(seed);
+        cache[seed] = tables;
+        return tables;
     }
+};
+
+class perlin {
+public:
+    explicit perlin(unsigned seed = 0) : tables(PerlinTables::get(seed)) {}
 
     double noise(const point3& p) const {
         auto u = p.x() - floor(p.x());
@@ -40,11 +92,11 @@ public:
         for (int di = 0; di < 2; ++di)
             for (int dj = 0; dj < 2; ++dj)
                 for (int dk = 0; dk < 2; ++dk)
-                    c[di][dj][dk] = randVec[
-                        permX[(i + di) & 255] ^
-                            permY[(j + dj) & 255] ^
-                            permZ[(k + dk) & 255]
-                    ];
+                    c[di][dj][dk] = gradient(
+                        tables->perm[(i + di) & 255][0] ^
+                            tables->perm[(j + dj) & 255][1] ^
+                            tables->perm[(k + dk) & 255][2]
+                    );
 
         return perlin_interp(c, u, v, w);
     }
@@ -63,31 +115,189 @@ public:
         return fabs(accum);
     }
 
-private:
-    static const int pointCount = 256;
-    vec3* randVec;
-    int* permX;
-    int* permY;
-    int* permZ;
+    //  noise() of `count` points given as separate x, y, z arrays. Points go through in groups
+    //  of batchSize : the lattice lookups stay scalar gathers, but every other step of a group
+    //  runs lane by lane over plain arrays, which the compiler turns into SIMD code.
+    void noise(const double* x, const double* y, const double* z, double* out, int count) const {
+        for (int first = 0; first < count; first += batchSize) {
+            int lanes = count - first < batchSize ? count - first : batchSize;
+            noise_batch(x + first, y + first, z + first, out + first, lanes);
+        }
+    }
 
-    static int* perlin_generate_perm() {
-        auto p = new int[pointCount];
+    void turb(const double* x, const double* y, const double* z, double* out, int count, int depth = 3) const {
+        double px[batchSize], py[batchSize], pz[batchSize], octave[batchSize];
 
-        for (int i = 0; i < perlin::pointCount; ++i)
-            p[i] = i;
+        for (int first = 0; first < count; first += batchSize) {
+            int lanes = count - first < batchSize ? count - first : batchSize;
+            for (int l = 0; l < lanes; ++l) {
+                px[l] = x[first + l];
+                py[l] = y[first + l];
+                pz[l] = z[first + l];
+                out[first + l] = 0;
+            }
 
-        permute(p, pointCount);
+            auto weight = 1.0;
+            for (int i = 0; i < depth; ++i) {
+                noise_batch(px, py, pz, octave, lanes);
+                for (int l = 0; l < lanes; ++l) {
+                    out[first + l] += weight * octave[l];
+                    px[l] *= 2;
+                    py[l] *= 2;
+                    pz[l] *= 2;
+                }
+                weight *= 0.5;
+            }
 
-        return p;
+            for (int l = 0; l < lanes; ++l)
+                out[first + l] = fabs(out[first + l]);
+        }
     }
 
-    static void permute(int* p, int n) {
-        for (int i = n - 1; i > 0; --i) {
-            int target = Util::random_int(0, i);
-            int tmp = p[i];
-            p[i] = p[target];
-            p[target] = tmp;
+    static const int batchSize = 8;
+
+    //  Bound of |noise(p) - noise(center)| for p in `box`, from the mean value theorem : noise is
+    //  continuously differentiable, and in each lattice cell the box meets its slope along an
+    //  axis is bounded from the corners' gradients, weights and dot products, all monotonic or
+    //  linear over the offsets the box reaches there. Tight for boxes small against a cell.
+    double variation_bound(const aabb& box) const {
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = static_cast<int>(floor(box.axis(a).min));
+            hi[a] = static_cast<int>(floor(box.axis(a).max));
         }
+
+        double slope[3] = { 0, 0, 0 };
+        for (int i = lo[0]; i <= hi[0]; ++i)
+            for (int j = lo[1]; j <= hi[1]; ++j)
+                for (int k = lo[2]; k <= hi[2]; ++k) {
+                    //  Positions and smoothed offsets the box reaches in this cell, the largest
+                    //  derivative of the smoothstep over each, and the largest weight of each side
+                    int cell[3] = { i, j, k };
+                    double offsetMin[3], offsetMax[3], maxStep[3], maxWeightSlope[3], maxWeight[3][2];
+                    for (int a = 0; a < 3; ++a) {
+                        double fMin = fmax(box.axis(a).min - cell[a], 0.0), fMax = fmin(box.axis(a).max - cell[a], 1.0);
+                        offsetMin[a] = fMin * fMin * (3 - 2 * fMin);
+                        offsetMax[a] = fMax * fMax * (3 - 2 * fMax);
+                        maxStep[a] = max_smoothstep_slope(fMin, fMax);
+                        maxWeightSlope[a] = max_smoothstep_slope(offsetMin[a], offsetMax[a]);
+                        maxWeight[a][0] = 1 - offsetMin[a] * offsetMin[a] * (3 - 2 * offsetMin[a]);
+                        maxWeight[a][1] = offsetMax[a] * offsetMax[a] * (3 - 2 * offsetMax[a]);
+                    }
+
+                    vec3 g[2][2][2];
+                    for (int di = 0; di < 2; ++di)
+                        for (int dj = 0; dj < 2; ++dj)
+                            for (int dk = 0; dk < 2; ++dk)
+                                g[di][dj][dk] = gradient(tables->perm[(i + di) & 255][0]
+                                    ^ tables->perm[(j + dj) & 255][1] ^ tables->perm[(k + dk) & 255][2]);
+
+                    //  d noise / d offset_a = sum over corners of d weight / d offset_a * dot
+                    //  + weight * gradient_a. Corners pair up along a, their weight derivatives
+                    //  being opposite : the first term is the weight slope times the pairs'
+                    //  differences of dot products, blended by the other two axes' weights.
+                    for (int a = 0; a < 3; ++a) {
+                        int b = (a + 1) % 3, c = (a + 2) % 3;
+                        double pairs = 0, largestPair = 0, gradients = 0, largestGradient = 0;
+                        for (int sb = 0; sb < 2; ++sb)
+                            for (int sc = 0; sc < 2; ++sc) {
+                                int corner[2][3];
+                                for (int side = 0; side < 2; ++side) {
+                                    corner[side][a] = side;
+                                    corner[side][b] = sb;
+                                    corner[side][c] = sc;
+                                }
+                                const vec3& g0 = g[corner[0][0]][corner[0][1]][corner[0][2]];
+                                const vec3& g1 = g[corner[1][0]][corner[1][1]][corner[1][2]];
+
+                                //  dot(g1, o - corner1) - dot(g0, o - corner0), linear in o
+                                double center = 0, spread = 0;
+                                for (int e = 0; e < 3; ++e) {
+                                    double mid = (offsetMin[e] + offsetMax[e]) / 2, half = (offsetMax[e] - offsetMin[e]) / 2;
+                                    center += g1[e] * (mid - corner[1][e]) - g0[e] * (mid - corner[0][e]);
+                                    spread += fabs(g1[e] - g0[e]) * half;
+                                }
+                                double difference = fabs(center) + spread;
+                                double otherWeight = maxWeight[b][sb] * maxWeight[c][sc];
+                                pairs += otherWeight * difference;
+                                largestPair = fmax(largestPair, difference);
+                                for (int side = 0; side < 2; ++side) {
+                                    gradients += otherWeight * maxWeight[a][side] * fabs(side ? g1[a] : g0[a]);
+                                    largestGradient = fmax(largestGradient, fabs(side ? g1[a] : g0[a]));
+                                }
+                            }
+
+                        //  Weights sum to 1, so no blend exceeds its largest term
+                        double dOffset = maxWeightSlope[a] * fmin(pairs, largestPair) + fmin(gradients, largestGradient);
+                        slope[a] = fmax(slope[a], maxStep[a] * dOffset);
+                    }
+                }
+
+        //  Padded for noise()'s float smoothstep
+        double result = 1e-5;
+        for (int a = 0; a < 3; ++a)
+            result += slope[a] * box.axis(a).size() / 2;
+        return result;
+    }
+
+private:
+    shared_ptr<const PerlinTables> tables;
+
+    vec3 gradient(int index) const {
+        const float* g = tables->gradient[index];
+        return vec3(g[0], g[1], g[2]);
+    }
+
+    void noise_batch(const double* x, const double* y, const double* z, double* out, int lanes) const {
+        // Same arithmetic as noise(). Loops run over the full batch, unused lanes included, so
+        // that their trip count is a constant the compiler can vectorize.
+        double u[batchSize], v[batchSize], w[batchSize];
+        double weightU[2][batchSize], weightV[2][batchSize], weightW[2][batchSize];
+        int hashX[2][batchSize], hashY[2][batchSize], hashZ[2][batchSize];
+        double result[batchSize];
+
+        for (int l = 0; l < batchSize; ++l) {
+            int lane = l < lanes ? l : 0;
+            double fx = floor(x[lane]), fy = floor(y[lane]), fz = floor(z[lane]);
+            int i = static_cast<int>(fx), j = static_cast<int>(fy), k = static_cast<int>(fz);
+
+            hashX[0][l] = tables->perm[i & 255][0];
+            hashX[1][l] = tables->perm[(i + 1) & 255][0];
+            hashY[0][l] = tables->perm[j & 255][1];
+            hashY[1][l] = tables->perm[(j + 1) & 255][1];
+            hashZ[0][l] = tables->perm[k & 255][2];
+            hashZ[1][l] = tables->perm[(k + 1) & 255][2];
+
+            u[l] = hermite_smoothstep(x[lane] - fx);
+            v[l] = hermite_smoothstep(y[lane] - fy);
+            w[l] = hermite_smoothstep(z[lane] - fz);
+            weightU[1][l] = u[l] * u[l] * (3 - 2 * u[l]);
+            weightV[1][l] = v[l] * v[l] * (3 - 2 * v[l]);
+            weightW[1][l] = w[l] * w[l] * (3 - 2 * w[l]);
+            weightU[0][l] = 1 - weightU[1][l];
+            weightV[0][l] = 1 - weightV[1][l];
+            weightW[0][l] = 1 - weightW[1][l];
+            result[l] = 0;
+        }
+
+        double gx[batchSize], gy[batchSize], gz[batchSize];
+        for (int di = 0; di < 2; ++di)
+            for (int dj = 0; dj < 2; ++dj)
+                for (int dk = 0; dk < 2; ++dk) {
+                    for (int l = 0; l < batchSize; ++l) {
+                        const float* g = tables->gradient[hashX[di][l] ^ hashY[dj][l] ^ hashZ[dk][l]];
+                        gx[l] = g[0];
+                        gy[l] = g[1];
+                        gz[l] = g[2];
+                    }
+
+                    for (int l = 0; l < batchSize; ++l)
+                        result[l] += weightU[di][l] * weightV[dj][l] * weightW[dk][l]
+                            * (gx[l] * (u[l] - di) + gy[l] * (v[l] - dj) + gz[l] * (w[l] - dk));
+                }
+
+        for (int l = 0; l < lanes; ++l)
+            out[l] = result[l];
     }
 
     static double trilinear_interp(double c[2][2][2], double u, double v, double w) {
@@ -121,6 +331,12 @@ private:
         return accum;
     }
 
+    //  Largest derivative 6 x (1 - x) of the smoothstep over [lo, hi], peaking at 1 / 2
+    static double max_smoothstep_slope(double lo, double hi) {
+        double x = fmin(fmax(0.5, lo), hi);
+        return 6 * x * (1 - x);
+    }
+
     static float hermite_smoothstep(float x) {
         // x is clamped to 0 ... 1
         return x * x * (3.0 - 2.0 * x);
@@ -0,0 +1,281 @@
+#ifndef SPARSE_VOLUME_H
+#define SPARSE_VOLUME_H
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../common.h"
+#include "../hittable/aabb.h"
+#include "density.h"
+#include "mappedFile.h"
+
+/*
+    Sparse brick volume file (.rtsv)
+
+        header
+        uint32 brickIndex[bricks.x * bricks.y * bricks.z]   slot of each brick, emptyBrick if none
+        float  brickData[numBricks][brickSize^3]            x fastest, then y, then z
+        float  brickMax[numBricks]
+
+    Only bricks holding some density are stored, so empty space costs 4 bytes per brick. The
+    header keeps the bake parameters, so load_or_bake can tell a file baked for other ones.
+*/
+namespace SparseVolume {
+
+    const char magic[4] = { 'R', 'T', 'S', 'V' };
+    const uint32_t version = 2;
+    const uint32_t emptyBrick = 0xFFFFFFFF;
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t brickSize;
+        uint32_t bricks[3];
+        uint32_t numBricks;
+        uint32_t padding;
+        double boundsMin[3];
+        double boundsMax[3];
+        double maxDensity;
+        double threshold;
+    };
+
+    //  Bricks along each axis for `resolution` voxels
+    inline uint32_t brick_count(int resolution, int brickSize) {
+        return static_cast<uint32_t>((resolution + brickSize - 1) / brickSize);
+    }
+
+    //  Samples `f` at voxel centers of a grid covering `bounds` and writes the non empty bricks.
+    //  Bricks are streamed to disk one at a time, the dense volume never exists in memory. The file
+    //  is written under a temporary name and renamed once complete.
+    inline void write(const std::string& filename, const aabb& bounds, int resolution,
+        const std::function<double(const point3&)>& f, int brickSize = 8, double threshold = 0.0) {
+
+        std::string partial = filename + ".partial";
+        std::ofstream file(partial, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Could not write " + filename);
+
+        Header header = {};
+        std::memcpy(header.magic, magic, 4);
+        header.version = version;
+        header.brickSize = brickSize;
+        header.threshold = threshold;
+        for (int a = 0; a < 3; ++a) {
+            header.bricks[a] = brick_count(resolution, brickSize);
+            header.boundsMin[a] = bounds.axis(a).min;
+            header.boundsMax[a] = bounds.axis(a).max;
+        }
+
+        size_t numCells = static_cast<size_t>(header.bricks[0]) * header.bricks[1] * header.bricks[2];
+        std::vector<uint32_t> brickIndex(numCells, emptyBrick);
+        std::vector<float> brickMax;
+        std::vector<float> brick(static_cast<size_t>(brickSize) * brickSize * brickSize);
+
+        //  Placeholders, rewritten once the bricks are known
+        file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+        file.write(reinterpret_cast<const char*>(brickIndex.data()), numCells * sizeof(uint32_t));
+
+        double voxelSize[3];
+        for (int a = 0; a < 3; ++a)
+            voxelSize[a] = bounds.axis(a).size() / (header.bricks[a] * brickSize);
+
+        size_t cell = 0;
+        for (uint32_t bz = 0; bz < header.bricks[2]; ++bz)
+            for (uint32_t by = 0; by < header.bricks[1]; ++by)
+                for (uint32_t bx = 0; bx < header.bricks[0]; ++bx, ++cell) {
+                    float maxValue = 0;
+                    size_t i = 0;
+                    for (int z = 0; z < brickSize; ++z)
+                        for (int y = 0; y < brickSize; ++y)
+                            for (int x = 0; x < brickSize; ++x, ++i) {
+                                point3 p(bounds.x.min + (bx * brickSize + x + 0.5) * voxelSize[0],
+                                    bounds.y.min + (by * brickSize + y + 0.5) * voxelSize[1],
+                                    bounds.z.min + (bz * brickSize + z + 0.5) * voxelSize[2]);
+                                double d = f(p);
+                                brick[i] = d > threshold ? static_cast<float>(d) : 0.0f;
+                                maxValue = fmax(maxValue, brick[i]);
+                            }
+
+                    if (maxValue <= 0)
+                        continue;
+
+                    brickIndex[cell] = static_cast<uint32_t>(brickMax.size());
+                    brickMax.push_back(maxValue);
+                    header.maxDensity = fmax(header.maxDensity, maxValue);
+                    file.write(reinterpret_cast<const char*>(brick.data()), brick.size() * sizeof(float));
+                }
+
+        file.write(reinterpret_cast<const char*>(brickMax.data()), brickMax.size() * sizeof(float));
+
+        header.numBricks = static_cast<uint32_t>(brickMax.size());
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+        file.write(reinterpret_cast<const char*>(brickIndex.data()), numCells * sizeof(uint32_t));
+
+        file.close();
+        if (!file)
+            throw std::runtime_error("Could not write " + filename);
+        std::error_code error;
+        std::filesystem::rename(partial, filename, error);
+        if (error)
+            throw std::runtime_error("Could not write " + filename);
+    }
+}
+
+/*
+    Density read straight from a memory mapped .rtsv file : only the bricks rays actually go
+    through are ever paged in. So the brick slots are not checked up front either : a slot past
+    numBricks reads as an empty brick, and a damaged file can not make a lookup leave the mapping.
+*/
+class SparseDensity : public DensityField {
+public:
+    SparseDensity(const std::string& filename) : file(filename) {
+        if (file.size() < sizeof(SparseVolume::Header))
+            throw std::runtime_error(filename + " is not a sparse volume");
+
+        std::memcpy(&header, file.begin(), sizeof(SparseVolume::Header));
+        if (std::memcmp(header.magic, SparseVolume::magic, 4) != 0 || header.version != SparseVolume::version)
+            throw std::runtime_error(filename + " is not a supported sparse volume");
+        if (header.brickSize == 0 || header.brickSize > maxBrickSize)
+            throw std::runtime_error(filename + " is damaged");
+        for (int a = 0; a < 3; ++a)
+            if (header.bricks[a] == 0 || header.bricks[a] > maxBricks || !(header.boundsMax[a] > header.boundsMin[a]))
+                throw std::runtime_error(filename + " is damaged");
+
+        brickSize = header.brickSize;
+        brickVoxels = static_cast<size_t>(brickSize) * brickSize * brickSize;
+        for (int a = 0; a < 3; ++a) {
+            bricks[a] = header.bricks[a];
+            res[a] = bricks[a] * brickSize;
+        }
+        bounds = aabb(point3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]),
+            point3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]));
+
+        size_t numCells = static_cast<size_t>(bricks[0]) * bricks[1] * bricks[2];
+        size_t indexOffset = sizeof(SparseVolume::Header);
+        size_t dataOffset = indexOffset + numCells * sizeof(uint32_t);
+        size_t maxOffset = dataOffset + header.numBricks * brickVoxels * sizeof(float);
+        if (file.size() < maxOffset + header.numBricks * sizeof(float))
+            throw std::runtime_error(filename + " is truncated");
+
+        brickIndex = reinterpret_cast<const uint32_t*>(file.begin() + indexOffset);
+        brickData = reinterpret_cast<const float*>(file.begin() + dataOffset);
+        brickMax = reinterpret_cast<const float*>(file.begin() + maxOffset);
+    }
+
+    double density(const point3& p) const override {
+        if (!bounds.x.contains(p.x()) || !bounds.y.contains(p.y()) || !bounds.z.contains(p.z()))
+            return 0;
+
+        double gx = (p.x() - bounds.x.min) / bounds.x.size() * res[0] - 0.5;
+        double gy = (p.y() - bounds.y.min) / bounds.y.size() * res[1] - 0.5;
+        double gz = (p.z() - bounds.z.min) / bounds.z.size() * res[2] - 0.5;
+
+        int x0 = static_cast<int>(floor(gx)), y0 = static_cast<int>(floor(gy)), z0 = static_cast<int>(floor(gz));
+        double fx = gx - x0, fy = gy - y0, fz = gz - z0;
+
+        double accum = 0;
+        for (int i = 0; i < 2; ++i)
+            for (int j = 0; j < 2; ++j)
+                for (int k = 0; k < 2; ++k)
+                    accum += (i * fx + (1 - i) * (1 - fx))
+                        * (j * fy + (1 - j) * (1 - fy))
+                        * (k * fz + (1 - k) * (1 - fz))
+                        * voxel(x0 + i, y0 + j, z0 + k);
+        return accum;
+    }
+
+    double max_density() const override { return header.maxDensity; }
+
+    double max_density(const aabb& region) const override {
+        // Per brick maxima of every brick touched by the interpolation inside region.
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; ++a) {
+            const interval& b = bounds.axis(a);
+            int voxelLo = static_cast<int>(floor((region.axis(a).min - b.min) / b.size() * res[a] - 0.5));
+            int voxelHi = static_cast<int>(floor((region.axis(a).max - b.min) / b.size() * res[a] - 0.5)) + 1;
+            lo[a] = Util::clamp(voxelLo, 0, res[a] - 1) / brickSize;
+            hi[a] = Util::clamp(voxelHi, 0, res[a] - 1) / brickSize;
+        }
+
+        double result = 0;
+        for (int z = lo[2]; z <= hi[2]; ++z)
+            for (int y = lo[1]; y <= hi[1]; ++y)
+                for (int x = lo[0]; x <= hi[0]; ++x) {
+                    uint32_t slot = brickIndex[(static_cast<size_t>(z) * bricks[1] + y) * bricks[0] + x];
+                    if (slot < header.numBricks)
+                        result = fmax(result, brickMax[slot]);
+                }
+        return result;
+    }
+
+    size_t brick_count() const { return header.numBricks; }
+
+    //  True if the file was baked over `region` at `resolution` with these bricks and threshold
+    bool baked_with(const aabb& region, int resolution, int _brickSize, double threshold) const {
+        if (static_cast<int>(header.brickSize) != _brickSize || header.threshold != threshold)
+            return false;
+        for (int a = 0; a < 3; ++a)
+            if (header.bricks[a] != SparseVolume::brick_count(resolution, _brickSize)
+                || header.boundsMin[a] != region.axis(a).min || header.boundsMax[a] != region.axis(a).max)
+                return false;
+        return true;
+    }
+
+private:
+    static const uint32_t maxBrickSize = 256;
+    static const uint32_t maxBricks = 1 << 16;
+
+    MappedFile file;
+    SparseVolume::Header header;
+    aabb bounds;
+    int brickSize;
+    size_t brickVoxels;
+    int bricks[3], res[3];
+    const uint32_t* brickIndex;
+    const float* brickData;
+    const float* brickMax;
+
+    double voxel(int x, int y, int z) const {
+        x = Util::clamp(x, 0, res[0] - 1);
+        y = Util::clamp(y, 0, res[1] - 1);
+        z = Util::clamp(z, 0, res[2] - 1);
+
+        uint32_t slot = brickIndex[(static_cast<size_t>(z / brickSize) * bricks[1] + y / brickSize) * bricks[0]
+            + x / brickSize];
+        if (slot >= header.numBricks)
+            return 0;   // emptyBrick, or out of range in a damaged file
+
+        int lx = x % brickSize, ly = y % brickSize, lz = z % brickSize;
+        return brickData[slot * brickVoxels + (static_cast<size_t>(lz) * brickSize + ly) * brickSize + lx];
+    }
+};
+
+namespace SparseVolume {
+
+    //  Density baked from `f` into `filename`, reusing the file when it was baked with the same
+    //  parameters. Missing, baked with other parameters or damaged, it is baked again. Changes to
+    //  `f` itself go unseen : the file must then be deleted, or named after them.
+    inline shared_ptr<SparseDensity> load_or_bake(const std::string& filename, const aabb& bounds, int resolution,
+        const std::function<double(const point3&)>& f, int brickSize = 8, double threshold = 0.0) {
+        try {
+            auto density = make_shared<SparseDensity>(filename);
+            if (density->baked_with(bounds, resolution, brickSize, threshold))
+                return density;
+        }
+        catch (const std::runtime_error&) {
+            //  Missing or damaged : baked below
+        }
+
+        write(filename, bounds, resolution, f, brickSize, threshold);
+        return make_shared<SparseDensity>(filename);
+    }
+}
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../common.h"
+#include "../../lib/stb_image.h"
+
+/*
+    Tiled mip-mapped texture file (.rttx)
+
+        header
+        LevelInfo level[numLevels]                  level 0 is the full resolution image
+        uint8     tiles[][tileSize^2 * 3]           sRGB, row major inside a tile, levels one after
+                                                    the other, tiles of a level row major
+
+    Lower levels are box filtered in linear space, as Image::build_mipmaps does, and only encoded
+    back to sRGB as their tiles are written.
+
+    Tiles on the right and bottom edges are padded by repeating the last texel, so every tile has
+    the same size and its offset follows from its index. The header records the size and time of
+    the source image the file was converted from, so a changed source is converted again.
+*/
+namespace TiledTexture {
+
+    const char magic[4] = { 'R', 'T', 'T', 'X' };
+    const uint32_t version = 3;
+    const int bytesPerTexel = 3;
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t tileSize;
+        uint32_t numLevels;
+        uint64_t sourceSize;
+        int64_t sourceTime;     // Last write time of the source, in the file system clock's ticks
+    };
+
+    struct LevelInfo {
+        uint32_t width, height;
+        uint32_t tilesX, tilesY;
+        uint64_t firstTile;
+    };
+
+    //  Size and last write time of `source`, false if it can not be read
+    inline bool source_info(const std::string& source, uint64_t& size, int64_t& time) {
+        std::error_code error;
+        size = std::filesystem::file_size(source, error);
+        if (error)
+            return false;
+        time = std::filesystem::last_write_time(source, error).time_since_epoch().count();
+        return !error;
+    }
+
+    //  Decodes `source` once to linear values, then writes every mip level of it tile by tile.
+    //  Only two levels are ever held in memory. The file is written under a temporary name and renamed once
+    //  complete, so an interrupted conversion never leaves a truncated file behind. Returns false
+    //  if the source image could not be loaded.
+    inline bool write(const std::string& source, const std::string& filename, int tileSize = 64) {
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (!source_info(source, sourceSize, sourceTime))
+            return false;
+
+        int width, height, n;
+        unsigned char* decoded = stbi_load(source.c_str(), &width, &height, &n, bytesPerTexel);
+        if (decoded == nullptr)
+            return false;
+
+        std::vector<float> current(static_cast<size_t>(width) * height * bytesPerTexel);
+        for (size_t i = 0; i < current.size(); ++i)
+            current[i] = srgb_to_linear(decoded[i]);
+        stbi_image_free(decoded);
+
+        std::string partial = filename + ".partial";
+        std::ofstream file(partial, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Could not write " + filename);
+
+        std::vector<LevelInfo> levels;
+        uint64_t numTiles = 0;
+        for (int w = width, h = height; ; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1) {
+            LevelInfo info;
+            info.width = w;
+            info.height = h;
+            info.tilesX = (w + tileSize - 1) / tileSize;
+            info.tilesY = (h + tileSize - 1) / tileSize;
+            info.firstTile = numTiles;
+            numTiles += static_cast<uint64_t>(info.tilesX) * info.tilesY;
+            levels.push_back(info);
+            if (w == 1 && h == 1)
+                break;
+        }
+
+        Header header = {};
+        std::memcpy(header.magic, magic, 4);
+        header.version = version;
+        header.tileSize = tileSize;
+        header.numLevels = static_cast<uint32_t>(levels.size());
+        header.sourceSize = sourceSize;
+        header.sourceTime = sourceTime;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+        file.write(reinterpret_cast<const char*>(levels.data()), levels.size() * sizeof(LevelInfo));
+
+        std::vector<unsigned char> tile(static_cast<size_t>(tileSize) * tileSize * bytesPerTexel);
+        for (size_t l = 0; l < levels.size(); ++l) {
+            const LevelInfo& info = levels[l];
+            int w = info.width, h = info.height;
+
+            for (uint32_t ty = 0; ty < info.tilesY; ++ty)
+                for (uint32_t tx = 0; tx < info.tilesX; ++tx) {
+                    unsigned char* dst = tile.data();
+                    for (int y = 0; y < tileSize; ++y)
+                        for (int x = 0; x < tileSize; ++x, dst += bytesPerTexel) {
+                            int sx = Util::clamp(static_cast<int>(tx) * tileSize + x, 0, w - 1);
+                            int sy = Util::clamp(static_cast<int>(ty) * tileSize + y, 0, h - 1);
+                            const float* src = &current[(static_cast<size_t>(sy) * w + sx) * bytesPerTexel];
+                            for (int c = 0; c < bytesPerTexel; ++c)
+                                dst[c] = linear_to_srgb(src[c]);
+                        }
+                    file.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+                }
+
+            if (l + 1 == levels.size())
+                break;
+
+            //  Box filter down to the next level
+            int nextW = levels[l + 1].width, nextH = levels[l + 1].height;
+            std::vector<float> next(static_cast<size_t>(nextW) * nextH * bytesPerTexel);
+            for (int y = 0; y < nextH; ++y)
+                for (int x = 0; x < nextW; ++x)
+                    for (int c = 0; c < bytesPerTexel; ++c) {
+                        float sum = 0;
+                        for (int dy = 0; dy < 2; ++dy)
+                            for (int dx = 0; dx < 2; ++dx) {
+                                int sx = Util::clamp(2 * x + dx, 0, w - 1);
+                                int sy = Util::clamp(2 * y + dy, 0, h - 1);
+                                sum += 0.25f * current[(static_cast<size_t>(sy) * w + sx) * bytesPerTexel + c];
+                            }
+                        next[(static_cast<size_t>(y) * nextW + x) * bytesPerTexel + c] = sum;
+                    }
+            current.swap(next);
+        }
+
+        file.close();
+        if (!file)
+            throw std::runtime_error("Could not write " + filename);
+
+        std::error_code error;
+        std::filesystem::rename(partial, filename, error);
+        if (error)
+            throw std::runtime_error("Could not write " + filename);
+        return true;
+    }
+}
+
+typedef std::vector<unsigned char> TextureTile;
+
+//  An opened .rttx file, tiles are read on request only. The constructor checks the levels and
+//  the file size against each other, so reading any tile of any level stays within the file.
+class TiledFile {
+public:
+    TiledFile(const std::string& filename) : file(filename, std::ios::binary) {
+        if (!file)
+            throw std::runtime_error(filename + " Not found");
+
+        file.read(reinterpret_cast<char*>(&header), sizeof(TiledTexture::Header));
+        if (!file || std::memcmp(header.magic, TiledTexture::magic, 4) != 0
+            || header.version != TiledTexture::version || header.tileSize == 0 || header.numLevels == 0
+            || header.numLevels > maxLevels)
+            throw std::runtime_error(filename + " is not a supported tiled texture");
+
+        levels.resize(header.numLevels);
+        file.read(reinterpret_cast<char*>(levels.data()), levels.size() * sizeof(TiledTexture::LevelInfo));
+        if (!file)
+            throw std::runtime_error(filename + " is truncated");
+
+        tileBytes = static_cast<size_t>(header.tileSize) * header.tileSize * TiledTexture::bytesPerTexel;
+        dataOffset = sizeof(TiledTexture::Header) + levels.size() * sizeof(TiledTexture::LevelInfo);
+
+        //  Each level half the previous one down to 1x1, its tiles right after the previous level's
+        uint64_t numTiles = 0;
+        for (size_t l = 0; l < levels.size(); ++l) {
+            const TiledTexture::LevelInfo& info = levels[l];
+            bool halved = l == 0 ? info.width > 0 && info.height > 0
+                : info.width == (levels[l - 1].width > 1 ? levels[l - 1].width / 2 : 1)
+                    && info.height == (levels[l - 1].height > 1 ? levels[l - 1].height / 2 : 1);
+            if (!halved || info.firstTile != numTiles
+                || info.tilesX != (info.width + header.tileSize - 1) / header.tileSize
+                || info.tilesY != (info.height + header.tileSize - 1) / header.tileSize)
+                throw std::runtime_error(filename + " is not a supported tiled texture");
+            numTiles += static_cast<uint64_t>(info.tilesX) * info.tilesY;
+        }
+        if (levels.back().width != 1 || levels.back().height != 1)
+            throw std::runtime_error(filename + " is not a supported tiled texture");
+
+        file.seekg(0, std::ios::end);
+        if (!file || static_cast<uint64_t>(file.tellg()) != dataOffset + numTiles * tileBytes)
+            throw std::runtime_error(filename + " is truncated");
+    }
+
+    //  True if the file was converted from `source` as it is now, with tiles of `tileSize`
+    bool is_current(const std::string& source, int tileSize) const {
+        uint64_t size;
+        int64_t time;
+        return TiledTexture::source_info(source, size, time) && size == header.sourceSize
+            && time == header.sourceTime && static_cast<int>(header.tileSize) == tileSize;
+    }
+
+    int tile_size() const { return header.tileSize; }
+
+    int num_levels() const { return static_cast<int>(levels.size()); }
+
+    const TiledTexture::LevelInfo& level(int l) const { return levels[l]; }
+
+    size_t tile_bytes() const { return tileBytes; }
+
+    shared_ptr<const TextureTile> read_tile(int l, int tx, int ty) const {
+        auto tile = make_shared<TextureTile>(tileBytes);
+        uint64_t index = levels[l].firstTile + static_cast<uint64_t>(ty) * levels[l].tilesX + tx;
+
+        std::lock_guard<std::mutex> lock(fileMutex);
+        file.seekg(static_cast<std::streamoff>(dataOffset + index * tileBytes));
+        file.read(reinterpret_cast<char*>(tile->data()), tileBytes);
+        if (!file)
+            throw std::runtime_error("Could not read texture tile");
+        return tile;
+    }
+
+private:
+    static const uint32_t maxLevels = 64;
+
+    mutable std::ifstream file;
+    mutable std::mutex fileMutex;
+    TiledTexture::Header header;
+    std::vector<TiledTexture::LevelInfo> levels;
+    size_t tileBytes;
+    size_t dataOffset;
+};
+
+/*
+    Process wide cache of texture tiles shared by every tiled texture. Tiles are loaded the first
+    time a lookup touches them and the least recently used ones are dropped once the loaded tiles
+    exceed the byte budget. Tiles are handed out as shared pointers, so a tile evicted while a
+    lookup still reads it stays alive until that lookup is done. Safe to use from several render
+    threads : the disk read itself happens outside of the cache lock.
+*/
+class TextureCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t bytesInUse = 0;
+        size_t peakBytes = 0;
+    };
+
+    static TextureCache& instance() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void set_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        budget = bytes;
+        evict();
+    }
+
+    size_t get_budget() const { return budget; }
+
+    //  Id of the tiled file, opened once per file name
+    int open(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = fileIds.find(filename);
+        if (it != fileIds.end())
+            return it->second;
+
+        files.push_back(make_shared<TiledFile>(filename));
+        int id = static_cast<int>(files.size()) - 1;
+        fileIds[filename] = id;
+        return id;
+    }
+
+    shared_ptr<const TiledFile> file(int id) const {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        return files[id];
+    }
+
+    shared_ptr<const TextureTile> tile(int id, int level, int tx, int ty) {
+        uint64_t key = (static_cast<uint64_t>(id) << 40) | (static_cast<uint64_t>(level) << 32)
+            | (static_cast<uint64_t>(ty) << 16) | static_cast<uint64_t>(tx);
+
+        shared_ptr<const TiledFile> source;
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                ++stats.hits;
+                lru.splice(lru.begin(), lru, it->second.position);
+                return it->second.tile;
+            }
+            ++stats.misses;
+            source = files[id];
+        }
+
+        auto loaded = source->read_tile(level, tx, ty);
+
+        std::lock_guard<std::mutex> lock(cacheMutex);
+
+        //  Another thread may have loaded the same tile in the meantime
+        auto it = entries.find(key);
+        if (it != entries.end())
+            return it->second.tile;
+
+        lru.push_front(key);
+        entries[key] = Entry{ loaded, lru.begin() };
+        stats.bytesInUse += loaded->size();
+        stats.peakBytes = stats.bytesInUse > stats.peakBytes ? stats.bytesInUse : stats.peakBytes;
+        evict();
+        return loaded;
+    }
+
+    Stats get_stats() const {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        return stats;
+    }
+
+    void print_stats(std::ostream& out) const {
+        Stats s = get_stats();
+        size_t lookups = s.hits + s.misses;
+        out << "Texture cache : " << s.hits << " hits, " << s.misses << " misses ("
+            << (lookups > 0 ? 100.0 * s.hits / lookups : 0.0) << "% hit rate), "
+            << s.evictions << " evictions, " << s.bytesInUse / 1024 << " KB in use, "
+            << s.peakBytes / 1024 << " KB peak, budget " << budget / 1024 << " KB" << std::endl;
+    }
+
+private:
+    struct Entry {
+        shared_ptr<const TextureTile> tile;
+        std::list<uint64_t>::iterator position;
+    };
+
+    mutable std::mutex cacheMutex;
+    size_t budget = 64 * 1024 * 1024;
+    std::vector<shared_ptr<TiledFile>> files;
+    std::map<std::string, int> fileIds;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru;               // Most recently used first
+    Stats stats;
+
+    TextureCache() {}
+
+    void evict() {
+        // Keeps at least one tile, the one just loaded, whatever the budget.
+        while (stats.bytesInUse > budget && lru.size() > 1) {
+            auto it = entries.find(lru.back());
+            stats.bytesInUse -= it->second.tile->size();
+            entries.erase(it);
+            lru.pop_back();
+            ++stats.evictions;
+        }
+    }
+};
+
+/*
+    Image read through the TextureCache instead of being held in memory. The source image is
+    converted to a .rttx file next to the renders the first time it is used, and again whenever
+    the source or the tile size changed since.
+*/
+class TiledImage {
+public:
+    TiledImage(const char* imageFilepath, int tileSize = 64) {
+        auto source = std::string("res") + "/" + imageFilepath;
+        auto tiledPath = std::string("./output/") + flatten(imageFilepath) + ".rttx";
+
+        bool current = false;
+        try {
+            current = TiledFile(tiledPath).is_current(source, tileSize);
+        }
+        catch (const std::runtime_error&) {
+            //  Missing, from an older version or damaged : converted again below
+        }
+
+        if (!current && !TiledTexture::write(source, tiledPath, tileSize)) {
+            std::cerr << "ERROR: Could not load image file '" << source << "'.\n";
+            return;
+        }
+
+        auto& cache = TextureCache::instance();
+        id = cache.open(tiledPath);
+        file = cache.file(id);
+    }
+
+    int width()  const { return file ? file->level(0).width : 0; }
+    int height() const { return file ? file->level(0).height : 0; }
+
+    void pixel_color(double u, double v, double filterWidth, double out[3]) const {
+        // Trilinear lookup, same filtering and clamp to edge wrapping as Image.
+
+        if (!file) {
+            out[0] = 1; out[1] = 0; out[2] = 1;
+            return;
+        }
+
+        u = Util::clamp(u, 0.0, 1.0);
+        v = 1 - Util::clamp(v, 0.0, 1.0);
+
+        int numLevels = file->num_levels();
+        int size = width() > height() ? width() : height();
+        double level = log2(fmax(filterWidth * size, 1e-8));
+
+        if (level <= 0) {
+            bilerp(0, u, v, out);
+            return;
+        }
+        if (level >= numLevels - 1) {
+            bilerp(numLevels - 1, u, v, out);
+            return;
+        }
+
+        int lower = static_cast<int>(level);
+        double blend = level - lower;
+        double colorLower[3], colorUpper[3];
+        bilerp(lower, u, v, colorLower);
+        bilerp(lower + 1, u, v, colorUpper);
+        for (int c = 0; c < 3; ++c)
+            out[c] = (1 - blend) * colorLower[c] + blend * colorUpper[c];
+    }
+
+private:
+    int id = -1;
+    shared_ptr<const TiledFile> file;
+
+    static std::string flatten(std::string path) {
+        for (char& c : path)
+            if (c == '/' || c == '\\')
+                c = '_';
+        return path;
+    }
+
+    void bilerp(int level, double u, double v, double out[3]) const {
+        const TiledTexture::LevelInfo& info = file->level(level);
+        int w = info.width, h = info.height;
+        int tileSize = file->tile_size();
+
+        double x = u * w - 0.5, y = v * h - 0.5;
+        int x0 = static_cast<int>(floor(x)), y0 = static_cast<int>(floor(y));
+        double fx = x - x0, fy = y - y0;
+
+        int xs[2] = { Util::clamp(x0, 0, w - 1), Util::clamp(x0 + 1, 0, w - 1) };
+        int ys[2] = { Util::clamp(y0, 0, h - 1), Util::clamp(y0 + 1, 0, h - 1) };
+        double wx[2] = { 1 - fx, fx }, wy[2] = { 1 - fy, fy };
+
+        //  The four texels usually share a tile, only fetch it again when they do not
+        auto& cache = TextureCache::instance();
+        shared_ptr<const TextureTile> tile;
+        int tileX = -1, tileY = -1;
+
+        out[0] = out[1] = out[2] = 0;
+        for (int j = 0; j < 2; ++j)
+            for (int i = 0; i < 2; ++i) {
+                int tx = xs[i] / tileSize, ty = ys[j] / tileSize;
+                if (tx != tileX || ty != tileY) {
+                    tile = cache.tile(id, level, tx, ty);
+                    tileX = tx;
+                    tileY = ty;
+                }
+
+                const unsigned char* texel = tile->data()
+                    + ((ys[j] % tileSize) * tileSize + xs[i] % tileSize) * TiledTexture::bytesPerTexel;
+                double weight = wx[i] * wy[j];
+                for (int c = 0; c < 3; ++c)
+                    out[c] += weight * srgb_to_linear(texel[c]);
+            }
+    }
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "threadPool.h"
+
+/*
+    Image decoded on first use rather than when the scene is built. Whichever comes first, a
+    lookup or a prefetch task, does the decode; anyone else asking meanwhile waits for it.
+*/
+class LazyImage {
+public:
+    LazyImage(const std::string& _filename, InterpolateMethod _interpolateMethod = InterpolateMethod::Nearest)
+        : filename(_filename), interpolateMethod(_interpolateMethod) {}
+
+    const Image& get() const {
+        std::call_once(decoded, [this] { image = Image(filename.c_str(), interpolateMethod); });
+        return image;
+    }
+
+private:
+    std::string filename;
+    InterpolateMethod interpolateMethod;
+    mutable Image image;
+    mutable std::once_flag decoded;
+};
+
+/*
+    Keeps track of the images created while the scene is built. prefetch() decodes all of the ones
+    nobody used yet on a thread pool, in parallel with each other and with the render.
+*/
+class TextureLoader {
+public:
+    static TextureLoader& instance() {
+        static TextureLoader loader;
+        return loader;
+    }
+
+    shared_ptr<const LazyImage> request(const std::string& filename,
+        InterpolateMethod interpolateMethod = InterpolateMethod::Nearest) {
+
+        auto image = make_shared<LazyImage>(filename, interpolateMethod);
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending.push_back(image);
+        return image;
+    }
+
+    //  Starts decoding every requested image and returns right away
+    void prefetch() {
+        std::vector<shared_ptr<const LazyImage>> images;
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            images.swap(pending);
+        }
+        if (images.empty())
+            return;
+
+        if (!pool)
+            pool.reset(new ThreadPool());
+        for (auto& image : images)
+            pool->submit([image] { image->get(); });
+    }
+
+private:
+    std::vector<shared_ptr<const LazyImage>> pending;
+    std::mutex pendingMutex;
+    std::unique_ptr<ThreadPool> pool;
+
+    TextureLoader() {}
+};
+
+#endif
@@ -7,11 +7,25 @@
 
 namespace Util {
 
+    //  Scalar type of the geometry (vectors, rays, bounds, transforms) : double by default, float
+    //  when built with RT_SINGLE_PRECISION
+#ifdef RT_SINGLE_PRECISION
+    typedef float Real;
+#else
+    typedef double Real;
+#endif
+
     const double infinity = std::numeric_limits<double>::infinity();
     const double pi = 3.1415926535897932385;
     const double invPi = 1 / pi;
     const double epsilon = 1e-6;
 
+    //  Bound on the relative error of n successive rounded operations in Real, see offset_ray_origin
+    inline Real gamma(int n) {
+        const Real unitRoundoff = std::numeric_limits<Real>::epsilon() / 2;
+        return (n * unitRoundoff) / (1 - n * unitRoundoff);
+    }
+
     // Utility Functions
 
     inline double degrees_to_radians(double degrees) {